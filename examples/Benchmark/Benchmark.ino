@@ -0,0 +1,191 @@
+/*
+ * Measures the AT command and socket throughput of the library and prints the
+ * results as a single JSON object on the debug stream, so they can be compared
+ * between library versions.
+ *
+ * The downlink is measured with the datagrams returned by an UDP echo server.
+ *
+ * The results include the network round trip times. To measure the cost of the
+ * library itself, run the HostBenchmark example against a simulated modem instead.
+ */
+
+#include <Sodaq_N3X.h>
+#include <Sodaq_wdt.h>
+
+#if defined(ARDUINO_SODAQ_SARA)
+/* SODAQ SARA AFF */
+#define DEBUG_STREAM SerialUSB
+#define MODEM_STREAM Serial1
+#else
+#error "Please select a SODAQ SARA board, or define the streams for your board."
+#endif
+
+#define AUTOMATIC_OPERATOR "0"
+
+#define CURRENT_APN      "iot.1nce.net"
+#define CURRENT_OPERATOR AUTOMATIC_OPERATOR
+#define CURRENT_BANDSEL  0
+
+#define ECHO_HOST        "195.34.89.241"    // echo.u-blox.com
+#define ECHO_PORT        7
+
+#define COMMAND_ITERATIONS  50
+#define SOCKET_ITERATIONS   10
+
+static Sodaq_N3X n3x;
+static Sodaq_SARA_N310_OnOff saraOnOff;
+
+static const size_t payloadSizes[] = { 16, 64, 128, 256, SODAQ_MAX_SEND_MESSAGE_SIZE };
+static uint8_t payload[SODAQ_MAX_SEND_MESSAGE_SIZE];
+
+// Prints "name": value as a JSON member.
+static void printMember(const char* name, float value, bool last = false)
+{
+    DEBUG_STREAM.print("  \"");
+    DEBUG_STREAM.print(name);
+    DEBUG_STREAM.print("\": ");
+    DEBUG_STREAM.print(value, 2);
+    DEBUG_STREAM.println(last ? "" : ",");
+}
+
+// Returns the number of operations per second.
+static float perSecond(uint32_t count, uint32_t ms)
+{
+    return ms > 0 ? count * 1000.0f / ms : 0;
+}
+
+static uint32_t benchmarkIsAlive()
+{
+    uint32_t start = millis();
+
+    for (uint16_t i = 0; i < COMMAND_ITERATIONS; i++) {
+        n3x.isAlive();
+    }
+
+    return millis() - start;
+}
+
+static uint32_t benchmarkRSSI()
+{
+    int8_t rssi;
+    uint8_t ber;
+    uint32_t start = millis();
+
+    for (uint16_t i = 0; i < COMMAND_ITERATIONS; i++) {
+        n3x.getRSSIAndBER(&rssi, &ber);
+    }
+
+    return millis() - start;
+}
+
+// Sends SOCKET_ITERATIONS datagrams of the given size and receives the echoed ones.
+// Returns the time spent sending and the number of datagrams sent successfully,
+// and adds the received bytes and time spent receiving.
+static uint32_t benchmarkSocket(int socketID, size_t size, uint32_t* sent, uint32_t* received, uint32_t* receiveTime)
+{
+    uint32_t sendTime = 0;
+
+    *sent = 0;
+
+    for (uint16_t i = 0; i < SOCKET_ITERATIONS; i++) {
+        uint32_t start = millis();
+        size_t sentLength = n3x.socketSend(socketID, ECHO_HOST, ECHO_PORT, payload, size);
+        sendTime += millis() - start;
+
+        if (sentLength == 0) {
+            continue;
+        }
+
+        (*sent)++;
+
+        if (n3x.socketWaitForReceive(socketID)) {
+            start = millis();
+
+            while (n3x.socketHasPendingBytes(socketID)) {
+                size_t count = n3x.socketReceive(socketID, payload, sizeof(payload));
+
+                if (count == 0) {
+                    break;
+                }
+
+                *received += count;
+            }
+
+            *receiveTime += millis() - start;
+        }
+    }
+
+    return sendTime;
+}
+
+void setup()
+{
+    sodaq_wdt_safe_delay(5000);
+
+    DEBUG_STREAM.begin(115200);
+    MODEM_STREAM.begin(n3x.getDefaultBaudrate());
+
+    n3x.init(&saraOnOff, MODEM_STREAM);
+
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = i;
+    }
+
+    uint32_t start = millis();
+    bool connected = n3x.connect(CURRENT_APN, CURRENT_OPERATOR, CURRENT_BANDSEL);
+    uint32_t connectTime = millis() - start;
+
+    DEBUG_STREAM.println("{");
+    printMember("connected", connected);
+    printMember("connect_ms", connectTime);
+
+    if (!connected) {
+        printMember("csq_time_s", n3x.getCSQtime(), true);
+        DEBUG_STREAM.println("}");
+        return;
+    }
+
+    printMember("csq_time_s", n3x.getCSQtime());
+    printMember("isalive_per_s", perSecond(COMMAND_ITERATIONS, benchmarkIsAlive()));
+    printMember("rssi_ber_per_s", perSecond(COMMAND_ITERATIONS, benchmarkRSSI()));
+
+    int socketID = n3x.socketCreate();
+
+    if (socketID < 0) {
+        printMember("socket_created", false, true);
+        DEBUG_STREAM.println("}");
+        return;
+    }
+
+    uint32_t received = 0;
+    uint32_t receiveTime = 0;
+
+    for (size_t i = 0; i < sizeof(payloadSizes) / sizeof(payloadSizes[0]); i++) {
+        char name[32];
+        uint32_t sent;
+        uint32_t ms = benchmarkSocket(socketID, payloadSizes[i], &sent, &received, &receiveTime);
+
+        snprintf(name, sizeof(name), "send_%u_datagrams_per_s", (unsigned)payloadSizes[i]);
+        printMember(name, perSecond(sent, ms));
+
+        snprintf(name, sizeof(name), "send_%u_bytes_per_s", (unsigned)payloadSizes[i]);
+        printMember(name, perSecond(sent * payloadSizes[i], ms));
+
+        snprintf(name, sizeof(name), "send_%u_failed", (unsigned)payloadSizes[i]);
+        printMember(name, SOCKET_ITERATIONS - sent);
+    }
+
+    n3x.socketClose(socketID);
+
+    printMember("receive_bytes", received);
+    printMember("receive_bytes_per_s", perSecond(received, receiveTime));
+    printMember("commands", n3x.getCommandCount());
+    printMember("errors", n3x.getErrorCount());
+    printMember("timeouts", n3x.getTimeoutCount(), true);
+    DEBUG_STREAM.println("}");
+}
+
+void loop()
+{
+    sodaq_wdt_safe_delay(1000);
+}
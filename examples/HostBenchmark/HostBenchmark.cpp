@@ -0,0 +1,465 @@
+/*
+ * Measures the cost of the library itself on a Linux host, against a simulated modem
+ * on the other side of a pseudo-terminal. The simulated modem transfers each byte in the
+ * time it takes at the baud rate, and attaches to a simulated network ATTACH_TIME ms after
+ * AT+COPS=0. Unlike the Benchmark sketch the results don't depend on a real network, and
+ * can be compared between library versions to find regressions.
+ *
+ * The results are printed as a single JSON object on stdout: the time connect() took,
+ * the operations per second, and the CPU time (in us) the library used per operation.
+ *
+ * The baud rate is the first argument, by default that of the modem. With 0 the simulated
+ * modem replies right away, to measure the CPU time only.
+ *
+ * Build it together with an Arduino API shim that uses sodaq_posix_millis() as millis(),
+ * for example:
+ *   g++ -O2 -I<shim> -I../../src HostBenchmark.cpp ../../src/Sodaq_N3X.cpp \
+ *       ../../src/Sodaq_N3X_PosixStream.cpp <shim sources> -o HostBenchmark
+ */
+
+#include <Sodaq_N3X.h>
+#include <Sodaq_N3X_PosixStream.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COMMAND_ITERATIONS  1000
+#define SOCKET_ITERATIONS   50
+
+// How long (in ms) the simulated network takes to attach.
+#define ATTACH_TIME         500
+
+// How long (in ms) the stream waits in poll() for the simulated modem, instead of spinning.
+#define READ_WAIT           1
+
+#define REMOTE_HOST         "127.0.0.1"
+#define REMOTE_PORT         7
+
+#define APN                 "benchmark"
+#define OPERATOR            "0"   // automatic
+
+static Sodaq_N3X n3x;
+static Sodaq_N3X_PosixStream modemStream;
+
+static const size_t payloadSizes[] = { 16, 64, 128, 256, SODAQ_MAX_SEND_MESSAGE_SIZE };
+static uint8_t payload[SODAQ_MAX_SEND_MESSAGE_SIZE];
+
+// The time spent in an operation, in wall clock and in CPU time of this process.
+struct Measurement {
+    uint64_t wallMicros;
+    uint64_t cpuMicros;
+};
+
+// The time (in us) a byte takes at the baud rate, with a start and a stop bit, or 0.
+static uint32_t byteMicros;
+
+static uint64_t clockMicros(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void startMeasurement(Measurement* m)
+{
+    m->wallMicros = clockMicros(CLOCK_MONOTONIC);
+    m->cpuMicros  = clockMicros(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void stopMeasurement(Measurement* m)
+{
+    m->wallMicros = clockMicros(CLOCK_MONOTONIC) - m->wallMicros;
+    m->cpuMicros  = clockMicros(CLOCK_PROCESS_CPUTIME_ID) - m->cpuMicros;
+}
+
+// Prints "name": value as a JSON member.
+static void printMember(const char* name, double value, bool last = false)
+{
+    printf("  \"%s\": %.2f%s\n", name, value, last ? "" : ",");
+}
+
+// Prints the operations per second and the CPU time per operation.
+static void printMeasurement(const char* name, uint32_t count, const Measurement& m)
+{
+    char member[48];
+
+    snprintf(member, sizeof(member), "%s_per_s", name);
+    printMember(member, m.wallMicros > 0 ? count * 1000000.0 / m.wallMicros : 0);
+
+    snprintf(member, sizeof(member), "%s_cpu_us", name);
+    printMember(member, count > 0 ? static_cast<double>(m.cpuMicros) / count : 0);
+}
+
+
+/******************************************************************************
+* Simulated modem
+*****************************************************************************/
+
+// Waits the time "count" bytes take at the baud rate.
+static void pace(size_t count)
+{
+    if (byteMicros > 0) {
+        usleep(count * byteMicros);
+    }
+}
+
+// Writes a reply of the simulated modem, a few bytes at a time at the baud rate.
+static void reply(int fd, const char* text)
+{
+    size_t size = strlen(text);
+
+    while (size > 0) {
+        size_t chunk = (size < 16) ? size : 16;
+
+        pace(chunk);
+
+        ssize_t count = write(fd, text, chunk);
+
+        if (count <= 0) {
+            return;
+        }
+
+        text += count;
+        size -= count;
+    }
+}
+
+// The state of the simulated modem and network.
+static bool     radioOn     = false;
+static char     apn[64]     = "";
+static char     defaultApn[64] = "";
+static uint64_t attachStart = 0;
+
+static bool isAttached()
+{
+    return attachStart > 0 && clockMicros(CLOCK_MONOTONIC) - attachStart >= ATTACH_TIME * 1000;
+}
+
+// Replies to a command like a SARA N3X with echo off would.
+// The datagram sent last is echoed back, announced with +UUSORF.
+static void handleCommand(int fd, const char* command)
+{
+    static char datagram[SODAQ_MAX_SEND_MESSAGE_SIZE * 2 + 1];
+    static char response[sizeof(datagram) + 64];
+    static int  pending = 0;
+    static int  offset  = 0;
+
+    int size;
+    int start = 0;
+
+    if (strcmp(command, "AT+CFUN?") == 0) {
+        reply(fd, radioOn ? "\r\n+CFUN: 1\r\n\r\nOK\r\n" : "\r\n+CFUN: 0\r\n\r\nOK\r\n");
+    }
+    else if (strcmp(command, "AT+CFUN=1") == 0) {
+        radioOn = true;
+        reply(fd, "\r\nOK\r\n");
+    }
+    else if (strcmp(command, "AT+CEREG?") == 0) {
+        if (isAttached()) {
+            reply(fd, "\r\n+CEREG: 2,1,\"1A2B\",\"00C0FFEE\",9\r\n\r\nOK\r\n");
+        }
+        else {
+            reply(fd, (attachStart > 0) ? "\r\n+CEREG: 2,2\r\n\r\nOK\r\n" : "\r\n+CEREG: 2,0\r\n\r\nOK\r\n");
+        }
+    }
+    else if (sscanf(command, "AT+CFGDFTPDN=1,\"%63[^\"]\"", defaultApn) == 1) {
+        reply(fd, "\r\nOK\r\n");
+    }
+    else if (strcmp(command, "AT+CFGDFTPDN?") == 0) {
+        snprintf(response, sizeof(response), "\r\n+CFGDFTPDN: 1,\"%s\"\r\n\r\nOK\r\n", defaultApn);
+        reply(fd, response);
+    }
+    else if (sscanf(command, "AT+CGDCONT=1,\"IP\",\"%63[^\"]\"", apn) == 1) {
+        reply(fd, "\r\nOK\r\n");
+    }
+    else if (strcmp(command, "AT+CGDCONT?") == 0) {
+        snprintf(response, sizeof(response), "\r\n+CGDCONT: 1,\"IP\",\"%s\",\"%s\",0,0,0,0\r\n\r\nOK\r\n",
+                 apn, isAttached() ? "10.0.0.1" : "0.0.0.0");
+        reply(fd, response);
+    }
+    else if (strcmp(command, "AT+COPS=0") == 0) {
+        if (radioOn && attachStart == 0) {
+            attachStart = clockMicros(CLOCK_MONOTONIC);
+        }
+
+        reply(fd, radioOn ? "\r\nOK\r\n" : "\r\n+CME ERROR: 3\r\n");
+    }
+    else if (strcmp(command, "AT+COPS?") == 0) {
+        reply(fd, isAttached() ? "\r\n+COPS: 0,2,\"20408\",9\r\n\r\nOK\r\n" : "\r\n+COPS: 0\r\n\r\nOK\r\n");
+    }
+    else if (strcmp(command, "AT+CPIN?") == 0) {
+        reply(fd, "\r\n+CPIN: READY\r\n\r\nOK\r\n");
+    }
+    else if (strcmp(command, "AT+CSQ") == 0) {
+        reply(fd, "\r\n+CSQ: 20,0\r\n\r\nOK\r\n");
+    }
+    else if (strncmp(command, "AT+USOCR=", 9) == 0) {
+        reply(fd, "\r\n+USOCR: 0\r\n\r\nOK\r\n");
+    }
+    else if (sscanf(command, "AT+USOST=%*d,\"%*[^\"]\",%*d,%d,\"%n", &size, &start) == 1 && start > 0) {
+        size_t length = strcspn(command + start, "\"");
+
+        if (length >= sizeof(datagram)) {
+            length = sizeof(datagram) - 1;
+        }
+
+        memcpy(datagram, command + start, length);
+        datagram[length] = 0;
+
+        pending = length / 2;
+        offset  = 0;
+
+        snprintf(response, sizeof(response), "\r\n+USOST: 0,%d\r\n\r\nOK\r\n\r\n+UUSORF: 0,%d\r\n", size, pending);
+        reply(fd, response);
+    }
+    else if (strcmp(command, "AT+USORF=0,0") == 0) {
+        snprintf(response, sizeof(response), "\r\n+USORF: 0,%d\r\n\r\nOK\r\n", pending);
+        reply(fd, response);
+    }
+    else if (sscanf(command, "AT+USORF=0,%d", &size) == 1) {
+        if (size > pending) {
+            size = pending;
+        }
+
+        snprintf(response, sizeof(response), "\r\n+USORF: 0,\"" REMOTE_HOST "\",%d,%d,\"%.*s\"\r\n\r\nOK\r\n",
+                 REMOTE_PORT, size, size * 2, datagram + offset * 2);
+        reply(fd, response);
+
+        pending -= size;
+        offset  += size;
+    }
+    else if (command[0] != 0) {
+        reply(fd, "\r\nOK\r\n");
+    }
+}
+
+// Reads the commands from the pseudo-terminal and replies to them, until it is closed.
+static void runModem(int fd)
+{
+    static char command[SODAQ_MAX_SEND_MESSAGE_SIZE * 2 + 64];
+    char buffer[256];
+    size_t length = 0;
+    ssize_t count;
+
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        // The bytes only arrived after the time they take at the baud rate.
+        pace(count);
+
+        for (ssize_t i = 0; i < count; i++) {
+            if (buffer[i] == '\r') {
+                command[length] = 0;
+                handleCommand(fd, command);
+                length = 0;
+            }
+            else if (buffer[i] != '\n' && length < sizeof(command) - 1) {
+                command[length++] = buffer[i];
+            }
+        }
+    }
+}
+
+// Starts the simulated modem in a child process, so its CPU time is not counted.
+// Returns the file descriptor of the terminal the library talks to, or -1 if that failed.
+static int startModem(pid_t* pid)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        return -1;
+    }
+
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+
+    // Raw mode, before the first byte goes through the terminal.
+    if (slave < 0 || !modemStream.begin(slave)) {
+        return -1;
+    }
+
+    *pid = fork();
+
+    if (*pid < 0) {
+        return -1;
+    }
+
+    if (*pid == 0) {
+        close(slave);
+        runModem(master);
+        _exit(0);
+    }
+
+    close(master);
+
+    return slave;
+}
+
+
+/******************************************************************************
+* Benchmarks
+*****************************************************************************/
+
+static void benchmarkIsAlive(Measurement* m)
+{
+    startMeasurement(m);
+
+    for (uint16_t i = 0; i < COMMAND_ITERATIONS; i++) {
+        n3x.isAlive();
+    }
+
+    stopMeasurement(m);
+}
+
+static void benchmarkRSSI(Measurement* m)
+{
+    int8_t rssi;
+    uint8_t ber;
+
+    startMeasurement(m);
+
+    for (uint16_t i = 0; i < COMMAND_ITERATIONS; i++) {
+        n3x.getRSSIAndBER(&rssi, &ber);
+    }
+
+    stopMeasurement(m);
+}
+
+// Sends SOCKET_ITERATIONS datagrams of the given size and receives the echoed ones.
+// Returns the number of datagrams sent successfully, and adds the received bytes.
+static uint32_t benchmarkSocket(int socketID, size_t size, Measurement* send, Measurement* receive,
+                                uint32_t* received)
+{
+    uint32_t sent = 0;
+    Measurement m;
+
+    for (uint16_t i = 0; i < SOCKET_ITERATIONS; i++) {
+        startMeasurement(&m);
+        size_t sentLength = n3x.socketSend(socketID, REMOTE_HOST, REMOTE_PORT, payload, size);
+        stopMeasurement(&m);
+
+        send->wallMicros += m.wallMicros;
+        send->cpuMicros  += m.cpuMicros;
+
+        if (sentLength == 0) {
+            continue;
+        }
+
+        sent++;
+
+        startMeasurement(&m);
+
+        // The +UUSORF follows the response right away, don't wait in poll() once it is read.
+        modemStream.setReadWait(0);
+        n3x.processURCs();
+        modemStream.setReadWait(READ_WAIT);
+
+        while (n3x.socketHasPendingBytes(socketID)) {
+            size_t count = n3x.socketReceive(socketID, payload, sizeof(payload));
+
+            if (count == 0) {
+                break;
+            }
+
+            *received += count;
+        }
+
+        stopMeasurement(&m);
+
+        receive->wallMicros += m.wallMicros;
+        receive->cpuMicros  += m.cpuMicros;
+    }
+
+    return sent;
+}
+
+int main(int argc, char* argv[])
+{
+    pid_t pid;
+    uint32_t baudrate = (argc > 1) ? strtoul(argv[1], NULL, 10) : n3x.getDefaultBaudrate();
+
+    byteMicros = (baudrate > 0) ? 10 * 1000000 / baudrate : 0;
+
+    if (startModem(&pid) < 0) {
+        perror("Starting the simulated modem");
+        return 1;
+    }
+
+    modemStream.setReadWait(READ_WAIT);
+    n3x.init(NULL, modemStream);
+
+    for (size_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = i;
+    }
+
+    Measurement m;
+
+    startMeasurement(&m);
+    bool connected = n3x.connect(APN, OPERATOR);
+    stopMeasurement(&m);
+
+    printf("{\n");
+    printMember("baudrate", baudrate);
+    printMember("connected", connected, !connected);
+
+    if (!connected) {
+        printf("}\n");
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    printMember("connect_ms", m.wallMicros / 1000.0);
+    printMember("connect_cpu_us", m.cpuMicros);
+
+    benchmarkIsAlive(&m);
+    printMeasurement("isalive", COMMAND_ITERATIONS, m);
+
+    benchmarkRSSI(&m);
+    printMeasurement("rssi_ber", COMMAND_ITERATIONS, m);
+
+    int socketID = n3x.socketCreate();
+
+    if (socketID < 0) {
+        printMember("socket_created", false, true);
+        printf("}\n");
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    uint32_t received = 0;
+    uint32_t receivedDatagrams = 0;
+    Measurement receive = { 0, 0 };
+
+    for (size_t i = 0; i < sizeof(payloadSizes) / sizeof(payloadSizes[0]); i++) {
+        char name[32];
+        Measurement send = { 0, 0 };
+        uint32_t sent = benchmarkSocket(socketID, payloadSizes[i], &send, &receive, &received);
+
+        snprintf(name, sizeof(name), "send_%u", (unsigned)payloadSizes[i]);
+        printMeasurement(name, sent, send);
+
+        snprintf(name, sizeof(name), "send_%u_failed", (unsigned)payloadSizes[i]);
+        printMember(name, SOCKET_ITERATIONS - sent);
+
+        receivedDatagrams += sent;
+    }
+
+    n3x.socketClose(socketID);
+
+    printMeasurement("receive", receivedDatagrams, receive);
+    printMember("receive_bytes", received);
+    printMember("commands", n3x.getCommandCount());
+    printMember("errors", n3x.getErrorCount());
+    printMember("timeouts", n3x.getTimeoutCount(), true);
+    printf("}\n");
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    return 0;
+}
@@ -32,24 +32,40 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "Sodaq_N3X.h"
 #include <Sodaq_wdt.h>
 #include "time.h"
+#include <inttypes.h>
 
 //#define DEBUG
 
+#define ABORT_TIMEOUT           10000
 #define ATTACH_TIMEOUT          180000
-#define ATTACH_NEED_REBOOT      40000
 #define COPS_TIMEOUT            180000
 #define EPOCH_TIME_YEAR_OFF     100        // years since 1900
 #define ISCONNECTED_CSQ_TIMEOUT 10000
 #define REBOOT_DELAY            1250
 #define REBOOT_TIMEOUT          15000
+#define REBOOT_DENIED_TIME      30000
+#define REBOOT_SEARCH_TIME      60000
+#define REBOOT_FAILED_COMMANDS  3
 #define SOCKET_CLOSE_TIMEOUT    120000
 #define SOCKET_CONNECT_TIMEOUT  120000
 #define SOCKET_WRITE_TIMEOUT    120000
+#define SIGNAL_QUALITY_TTL      5000
+#define SIGNAL_QUALITY_WEIGHT   0.25f      // the weight of a new sample in the moving averages
+#define UPING_MARGIN            5000       // extra time for all ping replies to arrive
 
 #define AUTOMATIC_OPERATOR      "0"
 
+// The range of +CME ERROR codes about the SIM (not inserted, PIN required, failure, ...).
+#define CME_ERROR_SIM_FIRST     10
+#define CME_ERROR_SIM_LAST      18
+
 #define SODAQ_GSM_TERMINATOR "\r\n"
 #define SODAQ_GSM_MODEM_DEFAULT_INPUT_BUFFER_SIZE 1024
+
+// The room a +USORF response takes in the input buffer besides the hex encoded data,
+// and the room left for the final result code behind the data decoded in place.
+#define USORF_OVERHEAD          48
+#define USORF_RESULT_RESERVE    64
 #define SODAQ_GSM_TERMINATOR_LEN (sizeof(SODAQ_GSM_TERMINATOR) - 1)
 
 #define STR_AT                 "AT"
@@ -57,6 +73,21 @@ POSSIBILITY OF SUCH DAMAGE.
 #define STR_RESPONSE_ERROR     "ERROR"
 #define STR_RESPONSE_CME_ERROR "+CME ERROR:"
 #define STR_RESPONSE_CMS_ERROR "+CMS ERROR:"
+#define STR_RESPONSE_USOST     "+USOST: "
+#define STR_RESPONSE_ABORTED   "ABORTED"
+
+#define STR_URC_CEREG          "+CEREG: "
+#define STR_URC_CSCON          "+CSCON: "
+#define STR_URC_UFOTAS         "+UFOTAS: "
+#define STR_URC_UUPING         "+UUPING: "
+#define STR_URC_UUPINGER       "+UUPINGER: "
+#define STR_URC_UUPSMR         "+UUPSMR: "
+#define STR_URC_UUSOCL         "+UUSOCL: "
+#define STR_URC_UUSORF         "+UUSORF: "
+
+// The length of a string literal, known at compile time.
+#define STRLEN(s)              (sizeof(s) - 1)
+#define STARTS_WITH(str, pre)  (strncmp(str, pre, STRLEN(pre)) == 0)
 
 #define NIBBLE_TO_HEX_CHAR(i)  ((i <= 9) ? ('0' + i) : ('A' - 10 + i))
 #define HIGH_NIBBLE(i)         ((i >> 4) & 0x0F)
@@ -76,6 +107,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #define debugPrintln(...)
 #endif
 
+#ifdef SODAQ_N3X_PROFILE
+#define profileScope(point) ProfileScope _profileScope(_profile[point])
+#else
+#define profileScope(point)
+#endif
+
 #define CR '\r'
 #define LF '\n'
 
@@ -85,6 +122,115 @@ POSSIBILITY OF SUCH DAMAGE.
 static inline bool is_timedout(uint32_t from, uint32_t nr_ms) __attribute__((always_inline));
 static inline bool is_timedout(uint32_t from, uint32_t nr_ms) { return (millis() - from) > nr_ms; }
 
+// The types of lines recognized by readResponse().
+enum LineTypes {
+    LineOther = 0,
+    LineEcho,
+    LineOK,
+    LineError
+};
+
+// Classifies a line by looking at its first characters only, instead of trying each
+// of the known final result codes in turn.
+static LineTypes classifyLine(const char* line)
+{
+    switch (line[0]) {
+    case 'A':
+        return (line[1] == 'T') ? LineEcho : LineOther;
+    case 'O':
+        return (line[1] == 'K') ? LineOK : LineOther;
+    case 'E':
+        return STARTS_WITH(line, STR_RESPONSE_ERROR) ? LineError : LineOther;
+    case '+':
+        if (line[1] == 'C' && line[2] == 'M') {
+            return (STARTS_WITH(line, STR_RESPONSE_CME_ERROR) || STARTS_WITH(line, STR_RESPONSE_CMS_ERROR)) ?
+                LineError : LineOther;
+        }
+        return LineOther;
+    default:
+        return LineOther;
+    }
+}
+
+// Parses the +CGDCONT response of context 1. Returns 1 if it has an IP address for the APN,
+// 0 if it has none yet, or -1 if it is not set up for the APN. Optionally gets its header compression.
+static int8_t parseApn(const char* buffer, const char* requiredAPN, int* headerCompression)
+{
+    if (strncmp(buffer, "1,\"IP\"", 6) == 0 && strncmp(buffer + 6, ",\"\"", 3) != 0) {
+        char apn[64];
+        char ip[32];
+        int hcomp = 0;
+
+        // ,"<APN>","<PDP_addr>",<d_comp>,<h_comp>,...
+        if (sscanf(buffer + 6, ",\"%63[^\"]\",\"%31[^\"]\",%*d,%d", apn, ip, &hcomp) < 2) { return -1; }
+
+        if (headerCompression) {
+            *headerCompression = hcomp;
+        }
+
+        if (strcmp(apn, requiredAPN) == 0) {
+            if (strlen(ip) >= 7 && strcmp(ip, "0.0.0.0") != 0) {
+                return 1;
+            }
+            else {
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Copies a cached identity value. Returns true if it is not empty.
+static bool copyIdentity(char* dst, size_t size, const char* src)
+{
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = 0;
+
+    return dst[0] != 0;
+}
+
+// Copies a (possibly NULL) connect() parameter, unless it already is the copy.
+static void copyParameter(char* dst, const char* src, size_t size)
+{
+    if (src == dst) {
+        return;
+    }
+
+    strncpy(dst, src ? src : "", size - 1);
+    dst[size - 1] = 0;
+}
+
+#ifdef SODAQ_N3X_PROFILE
+// Adds the time spent in the enclosing scope to a profile counter.
+class ProfileScope
+{
+public:
+    ProfileScope(ProfileCounter& counter) : _counter(counter), _start(micros()) {}
+
+    ~ProfileScope()
+    {
+        _counter.calls++;
+        _counter.micros += micros() - _start;
+    }
+
+private:
+    ProfileCounter& _counter;
+    uint32_t _start;
+};
+#endif
+
+// Holds the modem lock for the lifetime of the instance.
+class Sodaq_N3X::Lock
+{
+public:
+    Lock(Sodaq_N3X* modem) : _modem(modem) { _modem->lock(); }
+    ~Lock() { _modem->unlock(); }
+
+private:
+    Sodaq_N3X* _modem;
+};
+
 
 /******************************************************************************
 * Main
@@ -95,7 +241,44 @@ Sodaq_N3X::Sodaq_N3X() :
     _diagStream(0),
     _appendCommand(false),
     _CSQtime(0),
-    _startOn(0)
+    _startOn(0),
+    _lockFunction(0),
+    _unlockFunction(0),
+    _lockContext(0),
+    _urcHandler(0),
+    _urcHandlerContext(0),
+    _ciotConfigured(false),
+    _ciotSupported(CIoTOptimisationNone),
+    _ciotPreferred(CIoTOptimisationNone),
+    _headerCompression(HeaderCompressionOff),
+    _idleCallback(0),
+    _idleCallbackContext(0),
+    _waitTime(0),
+    _idleTime(0),
+    _waitDepth(0),
+    _socketWriteTimeout(SOCKET_WRITE_TIMEOUT),
+    _awaitingResponse(false),
+    _responseFrom(0),
+    _responseTimeout(0),
+    _commandCount(0),
+    _errorCount(0),
+    _timeoutCount(0),
+    _commandStart(0),
+    _powerState(PowerStateOff),
+    _powerStateSince(0),
+    _commandTime(0),
+    _messagesSent(0),
+    _bootProbeTimeout(450),
+    _bootTime(0),
+    _regStatus(-1),
+    _regStatusSince(0),
+    _failedCommands(0),
+    _lastCMEError(-1),
+    _networkStore(0),
+    _fastAttachTimeout(0),
+    _connectHistory(0),
+    _connectHistorySize(0),
+    _connectHistoryCount(0)
 {
     _isBufferInitialized = false;
     _inputBuffer         = 0;
@@ -103,9 +286,68 @@ Sodaq_N3X::Sodaq_N3X() :
     _lastRSSI            = 0;
     _minRSSI             = -113;  // dBm
     _onoff               = 0;
+    _hexModeSet          = false;
 
     memset(_socketClosedBit,    1, sizeof(_socketClosedBit));
     memset(_socketPendingBytes, 0, sizeof(_socketPendingBytes));
+    memset(_socketStatistics,   0, sizeof(_socketStatistics));
+    memset(_stateTime,          0, sizeof(_stateTime));
+    memset(&_connectTimeline,   0, sizeof(_connectTimeline));
+    memset(&_pingStatistics,    0, sizeof(_pingStatistics));
+
+    memset(_receiveHandlers,        0, sizeof(_receiveHandlers));
+    memset(_receiveHandlerContexts, 0, sizeof(_receiveHandlerContexts));
+    _delivering = false;
+
+    memset(_operations, 0, sizeof(_operations));
+    _activeOperation = -1;
+    _draining        = false;
+
+    memset(&_signalQuality, 0, sizeof(_signalQuality));
+    _signalSampleTime = 0;
+    _signalTTL        = SIGNAL_QUALITY_TTL;
+
+    memset(&_identity, 0, sizeof(_identity));
+    _identityValid = false;
+
+    _fotaStatus         = FOTAStatusIdle;
+    _fotaHandler        = 0;
+    _fotaHandlerContext = 0;
+    _fotaWaitTimeout    = 0;
+    _fotaReconnect      = false;
+
+    _connectApn[0]      = 0;
+    _connectOperator[0] = 0;
+    _connectBandSel[0]  = 0;
+
+    _pingActive    = false;
+    _pingRttSum    = 0;
+    _pingJitterSum = 0;
+    _pingLastRtt   = 0;
+
+    _rebootPolicy.deniedTime     = REBOOT_DENIED_TIME;
+    _rebootPolicy.searchTime     = REBOOT_SEARCH_TIME;
+    _rebootPolicy.failedCommands = REBOOT_FAILED_COMMANDS;
+    _rebootPolicy.attachTime     = 0;
+
+    memset(_retryStatistics, 0, sizeof(_retryStatistics));
+
+    // Probe right away, the AT command itself takes up to 450 ms
+    setRetryPolicy(RetryLoopOn,     RetryFixed,  0,    0,    0,    10);
+    setRetryPolicy(RetryLoopSIM,    RetryFixed,  250,  0,    0,    10);
+    setRetryPolicy(RetryLoopApn,    RetryFixed,  3000, 0,    0,    20);
+    setRetryPolicy(RetryLoopSignal, RetryLinear, 500,  1000, 5000, 0);
+    setRetryPolicy(RetryLoopAttach, RetryLinear, 500,  1000, 5000, 0);
+
+    _stateCurrent[PowerStateOff]       = 0;
+    _stateCurrent[PowerStateBooting]   = 15000;
+    _stateCurrent[PowerStateIdle]      = 6000;
+    _stateCurrent[PowerStateConnected] = 60000;
+    _stateCurrent[PowerStatePSM]       = 8;
+
+    #ifdef SODAQ_N3X_PROFILE
+    resetProfileCounters();
+    #endif
 }
 
 // Initializes the modem instance. Sets the modem stream and the on-off power pins.
@@ -119,27 +361,45 @@ void Sodaq_N3X::init(Sodaq_OnOffBee* onoff, Stream& stream, uint8_t cid)
 
     _onoff = onoff;
     _cid   = cid;
+
+    _powerStateSince = millis();
+    _powerState      = isOn() ? PowerStateIdle : PowerStateOff;
 }
 
 // Turns the modem on and returns true if successful.
 bool Sodaq_N3X::on()
 {
+    Lock lock(this);
+
     bool timeout;
+    uint32_t delay = 0;
     uint8_t i;
 
     _startOn = millis();
 
-    if (!isOn() && _onoff) {
+    // The modem may have restarted since, with the default settings.
+    _hexModeSet = false;
+
+    bool poweredUp = !isOn() && _onoff;
+
+    if (poweredUp) {
+        setPowerState(PowerStateBooting);
+        resetRebootEvidence();
+        resetFOTAStatus();
         _onoff->on();
     }
 
     // wait for power up
     timeout = true;
-    for (i = 0; i < 10; i++) {
-        if (isAlive()) {
+    for (i = 1; ; i++) {
+        if (execCommand(STR_AT, _bootProbeTimeout)) {
             timeout = false;
             break;
         }
+
+        if (!retryWait(RetryLoopOn, i, &delay)) {
+            break;
+        }
     }
 
     if (timeout) {
@@ -147,31 +407,143 @@ bool Sodaq_N3X::on()
         return false;
     }
 
+    // The SIM may have been changed while the modem was off.
+    if (poweredUp && _identityValid) {
+        checkIdentity();
+    }
+
+    if (_powerState == PowerStateBooting || _powerState == PowerStateOff) {
+        _bootTime = millis() - _startOn;
+        setPowerState(PowerStateIdle);
+    }
+
     return isOn(); // this essentially means isOn() && isAlive()
 }
 
 // Turns the modem off and returns true if successful.
 bool Sodaq_N3X::off()
 {
+    Lock lock(this);
+
     // No matter if it is on or off, turn it off.
     if (_onoff) {
         _onoff->off();
     }
 
+    setPowerState(PowerStateOff);
+    resetRebootEvidence();
+    _signalSampleTime = 0;
+    _hexModeSet       = false;
+
     return !isOn();
 }
 
 // Turns on and initializes the modem, then connects to the network and activates the data connection.
 bool Sodaq_N3X::connect(const char* apn, const char* forceOperator, const char* bandSel)
+{
+    Lock lock(this);
+
+    memset(&_connectTimeline, 0, sizeof(_connectTimeline));
+    _connectTimeline.start = _startOn = millis();
+
+    // Keep the parameters, to connect again after a firmware update.
+    copyParameter(_connectApn,      apn,           sizeof(_connectApn));
+    copyParameter(_connectOperator, forceOperator, sizeof(_connectOperator));
+    copyParameter(_connectBandSel,  bandSel,       sizeof(_connectBandSel));
+
+    _connectTimeline.success  = doConnect(apn, forceOperator, bandSel);
+    _connectTimeline.duration = millis() - _connectTimeline.start;
+
+    if (_connectTimeline.success) {
+        _fotaReconnect = false;
+    }
+
+    if (_connectHistory && _connectHistorySize > 0) {
+        _connectHistory[_connectHistoryCount % _connectHistorySize] = _connectTimeline;
+        _connectHistoryCount++;
+    }
+
+    return _connectTimeline.success;
+}
+
+// Sets the store of the network the modem last attached to.
+void Sodaq_N3X::setNetworkStore(Sodaq_N3X_NetworkStore* store, uint32_t timeout)
+{
+    _networkStore      = store;
+    _fastAttachTimeout = timeout;
+}
+
+// Returns the reason the modem should be rebooted to recover, or RebootReasonNone.
+// "attachTime" is the time the last attempt to attach took, if any.
+RebootReasons Sodaq_N3X::getRebootReason(uint32_t attachTime) const
+{
+    uint32_t regStatusTime = millis() - _regStatusSince;
+
+    if (_rebootPolicy.failedCommands > 0 && _failedCommands >= _rebootPolicy.failedCommands) {
+        return RebootReasonFailedCommands;
+    }
+
+    if (_rebootPolicy.deniedTime > 0 && _regStatus == RegStatusDenied && regStatusTime >= _rebootPolicy.deniedTime) {
+        return RebootReasonDenied;
+    }
+
+    if (_rebootPolicy.searchTime > 0 && _regStatus == RegStatusNotSearching && regStatusTime >= _rebootPolicy.searchTime) {
+        return RebootReasonNotSearching;
+    }
+
+    if (_rebootPolicy.attachTime > 0 && attachTime > _rebootPolicy.attachTime) {
+        return RebootReasonAttachTime;
+    }
+
+    return RebootReasonNone;
+}
+
+// Sets the delays between the attempts of one of the retry loops.
+void Sodaq_N3X::setRetryPolicy(RetryLoops loop, RetrySchedules schedule, uint32_t initialDelay, uint32_t increment,
+                               uint32_t maxDelay, uint8_t maxAttempts)
+{
+    RetryPolicy& policy = _retryPolicy[loop];
+
+    policy.schedule     = schedule;
+    policy.initialDelay = initialDelay;
+    policy.increment    = increment;
+    policy.maxDelay     = maxDelay;
+    policy.maxAttempts  = maxAttempts;
+}
+
+// Keeps the timeline of the last "size" connect() attempts in the given buffer.
+void Sodaq_N3X::setConnectHistory(ConnectTimeline* buffer, uint8_t size)
+{
+    _connectHistory      = buffer;
+    _connectHistorySize  = size;
+    _connectHistoryCount = 0;
+}
+
+// Runs the connect() sequence, recording the end of each phase in the connect timeline.
+bool Sodaq_N3X::doConnect(const char* apn, const char* forceOperator, const char* bandSel)
 {
     uint32_t tm;
+    uint32_t delay;
     uint8_t i;
     int8_t j;
+    bool useStoredNetwork;
+    NetworkInfo storedNetwork;
+
+    bool wasOn = isOn() && _powerState != PowerStateOff;
 
     if (!on()) {
         return false;
     }
 
+    markConnectPhase(ConnectPhaseOn);
+
+    // Skip the whole sequence if the modem was left on and is still connected as requested.
+    // Not after a firmware update, the restart reset the settings of the modem.
+    if (wasOn && !_fotaReconnect && isConnectedTo(apn, forceOperator, bandSel)) {
+        _connectTimeline.warm = true;
+        return true;
+    }
+
     purgeAllResponsesRead();
 
     if (!execCommand("ATE0")) {
@@ -186,23 +558,68 @@ bool Sodaq_N3X::connect(const char* apn, const char* forceOperator, const char*
         return false;
     }
 
+    if (!setHexMode()) {
+        return false;
+    }
+
+    if (!applyCIoTOptimisation()) {
+        return false;
+    }
+
+    if (!enableURCs()) {
+        return false;
+    }
+
+    markConnectPhase(ConnectPhaseInit);
+
     if (!checkCFUN()) {
         return false;
     }
 
+    markConnectPhase(ConnectPhaseCFUN);
+
     if(bandSel != 0 && !setBandSel(bandSel))
     {
         return false;
     }
 
+    markConnectPhase(ConnectPhaseBandSel);
+
     if (!setDefaultApn(apn)) {
         return false;
     }
 
-    if (!setOperator(forceOperator)) {
+    markConnectPhase(ConnectPhaseDefaultApn);
+
+    // Try the network of the last successful attach first, with a short timeout.
+    useStoredNetwork = _networkStore != NULL &&
+                       (forceOperator == NULL || forceOperator[0] == 0 || strcmp(forceOperator, AUTOMATIC_OPERATOR) == 0) &&
+                       _networkStore->load(&storedNetwork) && storedNetwork.plmn[0] != 0;
+
+    if (useStoredNetwork) {
+        uint32_t errorCount     = _errorCount;
+        uint32_t timeoutCount   = _timeoutCount;
+        uint8_t  failedCommands = _failedCommands;
+
+        _connectTimeline.fastAttach = setOperator(storedNetwork.plmn, _fastAttachTimeout);
+
+        // The fallback is expected, a failed attempt is no evidence for the reboot policy
+        // nor for the health score.
+        if (!_connectTimeline.fastAttach) {
+            _errorCount     = errorCount;
+            _timeoutCount   = timeoutCount;
+            _failedCommands = failedCommands;
+        }
+    }
+
+    // Fall back to the full search, which has to be done explicitly after a manual selection.
+    if (!_connectTimeline.fastAttach && !isOperatorSelected(forceOperator) &&
+            !setOperator(useStoredNetwork ? AUTOMATIC_OPERATOR : forceOperator)) {
         return false;
     }
 
+    markConnectPhase(ConnectPhaseOperator);
+
     if (!setApn(apn)) {
         return false;
     }
@@ -211,11 +628,15 @@ bool Sodaq_N3X::connect(const char* apn, const char* forceOperator, const char*
         return false;
     }
 
-    j = 0;
-    for (i = 0; i < 20; i++) {
+    markConnectPhase(ConnectPhaseApn);
+
+    delay = 0;
+    for (i = 1; ; i++) {
         j = checkApn(apn);
-        sodaq_wdt_safe_delay(3000);
-        if (j > 0) {
+        _connectTimeline.apnChecks++;
+
+        // This also waits once the APN is ready, to let the PDP context settle.
+        if (!retryWait(RetryLoopApn, i, &delay) || j > 0) {
             break;
         }
     }
@@ -223,18 +644,35 @@ bool Sodaq_N3X::connect(const char* apn, const char* forceOperator, const char*
         return false;
     }
 
+    markConnectPhase(ConnectPhaseApnCheck);
+
     tm = millis();
 
     if (!waitForSignalQuality()) {
         return false;
     }
 
-    if (j == 0 && !attachGprs(ATTACH_TIMEOUT)) {
-        return false;
+    markConnectPhase(ConnectPhaseSignal);
+
+    bool attached = (j > 0) || attachGprs(ATTACH_TIMEOUT);
+
+    markConnectPhase(ConnectPhaseAttach);
+
+    if (!attached) {
+        _connectTimeline.rebootReason = getRebootReason(millis() - tm);
+
+        if (_connectTimeline.rebootReason == RebootReasonNone) {
+            return false;
+        }
+    }
+    else if (_rebootPolicy.attachTime > 0 && millis() - tm > _rebootPolicy.attachTime) {
+        // Once attached, only a slow attach asks for a reboot.
+        _connectTimeline.rebootReason = RebootReasonAttachTime;
     }
 
-    if (millis() - tm > ATTACH_NEED_REBOOT) {
+    if (_connectTimeline.rebootReason != RebootReasonNone) {
         reboot();
+        _connectTimeline.rebooted = true;
 
         if (!waitForSignalQuality()) {
             return false;
@@ -243,149 +681,410 @@ bool Sodaq_N3X::connect(const char* apn, const char* forceOperator, const char*
         if (!attachGprs(ATTACH_TIMEOUT)) {
             return false;
         }
+
+        markConnectPhase(ConnectPhaseReboot);
+    }
+
+    if (!doSIMcheck()) {
+        return false;
+    }
+
+    markConnectPhase(ConnectPhaseSIM);
+
+    NetworkInfo network;
+
+    if (_networkStore != NULL && getNetworkInfo(&network) &&
+            (!useStoredNetwork || strcmp(network.plmn, storedNetwork.plmn) != 0 ||
+             network.tac != storedNetwork.tac || network.cellId != storedNetwork.cellId)) {
+        _networkStore->save(network);
     }
 
-    return doSIMcheck();
+    return true;
 }
 
-// Disconnects the modem from the network.
-bool Sodaq_N3X::disconnect()
+// Sets the CIoT optimisations and the header compression applied by connect().
+void Sodaq_N3X::setCIoTOptimisation(CIoTOptimisations supported, CIoTOptimisations preferred,
+                                    HeaderCompressions headerCompression)
 {
-    return execCommand("AT+COPS=2", 40000);
+    _ciotConfigured    = true;
+    _ciotSupported     = supported;
+    _ciotPreferred     = preferred;
+    _headerCompression = headerCompression;
 }
 
+// Reads the CIoT optimisations the modem supports and prefers.
+bool Sodaq_N3X::getCIoTOptimisation(CIoTOptimisations* supported, CIoTOptimisations* preferred)
+{
+    Lock lock(this);
 
-/******************************************************************************
-* Public
-*****************************************************************************/
+    char buffer[32];
+    int n;
+    int supportedOpt;
+    int preferredOpt;
 
-bool Sodaq_N3X::attachGprs(uint32_t timeout)
-{
-    uint32_t start = millis();
-    uint32_t delay_count = 500;
+    println("AT+CCIOTOPT?");
 
-    while (!is_timedout(start, timeout)) {
-        if (isDefinedIP4()) {
-            return true;
-        }
+    // +CCIOTOPT: <n>,<supported_UE_opt>,<preferred_UE_opt>
+    if (readResponse(buffer, sizeof(buffer), "+CCIOTOPT: ") != GSMResponseOK) {
+        return false;
+    }
 
-        sodaq_wdt_safe_delay(delay_count);
+    if (sscanf(buffer, "%d,%d,%d", &n, &supportedOpt, &preferredOpt) != 3) {
+        return false;
+    }
 
-        // Next time wait a little longer, but not longer than 5 seconds
-        if (delay_count < 5000) {
-            delay_count += 1000;
-        }
+    if (supported) {
+        *supported = (CIoTOptimisations)supportedOpt;
     }
 
-    return false;
+    if (preferred) {
+        *preferred = (CIoTOptimisations)preferredOpt;
+    }
+
+    return true;
 }
 
-// Gets Integrated Circuit Card ID.
-// Should be provided with a buffer of at least 21 bytes.
-// Returns true if successful.
-bool Sodaq_N3X::getCCID(char* buffer, size_t size)
+// Sets the configured CIoT optimisations, if they differ from the modem settings.
+bool Sodaq_N3X::applyCIoTOptimisation()
 {
-    if (buffer == NULL || size < 20 + 1) {
-        return false;
+    CIoTOptimisations supported;
+    CIoTOptimisations preferred;
+
+    if (!_ciotConfigured) {
+        return true;
     }
 
-    println("AT+CCID");
+    if (getCIoTOptimisation(&supported, &preferred) && supported == _ciotSupported && preferred == _ciotPreferred) {
+        return true;
+    }
+
+    print("AT+CCIOTOPT=0,");
+    print(_ciotSupported);
+    print(',');
+    println(_ciotPreferred);
 
-    return (readResponse(buffer, size, "+CCID: ") == GSMResponseOK) && (strlen(buffer) > 0);
+    return (readResponse() == GSMResponseOK);
 }
 
-bool Sodaq_N3X::getCellId(uint16_t* tac, uint32_t* cid)
+// Returns true if the radio is on, the modem is registered and has an IP address for the given APN,
+// and the forced operator, band selection and configured CIoT optimisations are those in use.
+// Costs a single (concatenated) command.
+bool Sodaq_N3X::isConnectedTo(const char* apn, const char* forceOperator, const char* bandSel)
 {
-    char responseBuffer[64];
+    char buffer[384];
+    bool useOperator = forceOperator != NULL && forceOperator[0] != 0 && strcmp(forceOperator, AUTOMATIC_OPERATOR) != 0;
+    bool useBandSel  = bandSel != NULL && bandSel[0] != 0;
 
-    println("AT+CEREG=2");
+    bool radioOn     = false;
+    bool registered  = false;
+    bool apnReady    = false;
+    bool operatorSet = !useOperator;
+    bool bandSelSet  = !useBandSel;
+    bool ciotSet     = !_ciotConfigured;
 
-    if (readResponse() != GSMResponseOK) {
-        return false;
+    print("AT+CFUN?;+CEREG?");
+
+    if (useOperator) {
+        print(";+COPS=3,2;+COPS?");
     }
 
-    println("AT+CEREG?");
+    if (useBandSel) {
+        print(";+UBANDSEL?");
+    }
 
-    memset(responseBuffer, 0, sizeof(responseBuffer));
+    if (_ciotConfigured) {
+        print(";+CCIOTOPT?");
+    }
 
-    if ((readResponse(responseBuffer, sizeof(responseBuffer), "+CEREG: ") == GSMResponseOK) && (strlen(responseBuffer) > 0)) {
+    // Last, a long list of contexts is cut off at the end of the buffer.
+    println(";+CGDCONT?");
 
-        if (sscanf(responseBuffer, "2,%*d,\"%hx\",\"%lx\",", tac, cid) == 2) {
-            return true;
+    if (readResponse(buffer, sizeof(buffer)) != GSMResponseOK) {
+        return false;
+    }
+
+    for (char* line = strtok(buffer, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        int param1;
+        int param2;
+        char plmn[7];
+
+        if (STARTS_WITH(line, "+CFUN: ")) {
+            radioOn = (line[STRLEN("+CFUN: ")] == '1');
+        }
+        // +CEREG: <n>,<stat>[,...]
+        else if (STARTS_WITH(line, STR_URC_CEREG) &&
+                sscanf(line + STRLEN(STR_URC_CEREG), "%d,%d", &param1, &param2) == 2) {
+            setRegistrationStatus(param2);
+            registered = (param2 == RegStatusHome || param2 == RegStatusRoaming);
+        }
+        else if (STARTS_WITH(line, "+COPS: ")) {
+            operatorSet = sscanf(line + STRLEN("+COPS: "), "%*d,%*d,\"%6[0-9]\"", plmn) == 1 &&
+                          strcmp(plmn, forceOperator) == 0;
+        }
+        else if (STARTS_WITH(line, "+UBANDSEL: ")) {
+            bandSelSet = strcmp(line + STRLEN("+UBANDSEL: "), bandSel) == 0;
+        }
+        // +CCIOTOPT: <n>,<supported_UE_opt>,<preferred_UE_opt>
+        else if (STARTS_WITH(line, "+CCIOTOPT: ")) {
+            ciotSet = sscanf(line + STRLEN("+CCIOTOPT: "), "%*d,%d,%d", &param1, &param2) == 2 &&
+                      param1 == _ciotSupported && param2 == _ciotPreferred;
+        }
+        else if (STARTS_WITH(line, "+CGDCONT: ") && parseApn(line + STRLEN("+CGDCONT: "), apn, &param1) == 1) {
+            apnReady = !_ciotConfigured || param1 == _headerCompression;
         }
     }
 
-    return false;
+    return radioOn && registered && apnReady && operatorSet && bandSelSet && ciotSet;
 }
 
-bool Sodaq_N3X::getEpoch(uint32_t* epoch)
+// Returns true if the given operator is forced and the modem is already registered with it.
+bool Sodaq_N3X::isOperatorSelected(const char* forceOperator)
 {
-    char buffer[128];
-
-    println("AT+CCLK?");
+    NetworkInfo network;
 
-    if (readResponse(buffer, sizeof(buffer), "+CCLK: ") != GSMResponseOK) {
+    if (forceOperator == NULL || forceOperator[0] == 0 || strcmp(forceOperator, AUTOMATIC_OPERATOR) == 0) {
         return false;
     }
 
-    // format: "yy/MM/dd,hh:mm:ss+TZ
-    int y, m, d, h, min, sec, tz;
-    if (sscanf(buffer, "\"%u/%u/%u,%u:%u:%u+%u\"", &y, &m, &d, &h, &min, &sec, &tz) == 7 ||
-        sscanf(buffer, "\"%u/%u/%u,%u:%u:%u\"", &y, &m, &d, &h, &min, &sec) == 6)
-    {
-        *epoch = convertDatetimeToEpoch(y, m, d, h, min, sec);
-        return true;
-    }
+    return getNetworkInfo(&network) && strcmp(network.plmn, forceOperator) == 0;
+}
 
-    return false;
+// Records the time the given connect() phase ended, relative to the start of connect().
+void Sodaq_N3X::markConnectPhase(ConnectPhases phase)
+{
+    _connectTimeline.phaseEnd[phase] = millis() - _connectTimeline.start;
 }
 
-bool Sodaq_N3X::getFirmwareVersion(char* buffer, size_t size)
+// Takes the modem lock, if any.
+void Sodaq_N3X::lock()
 {
-    if (buffer == NULL || size < 30 + 1) {
-        return false;
+    if (_lockFunction) {
+        _lockFunction(_lockContext);
     }
-
-    return execCommand("AT+CGMR", DEFAULT_READ_MS, buffer, size);
 }
 
-bool Sodaq_N3X::getFirmwareRevision(char* buffer, size_t size)
+// Releases the modem lock, if any.
+void Sodaq_N3X::unlock()
 {
-    if (buffer == NULL || size < 30 + 1) {
-        return false;
+    if (_unlockFunction) {
+        _unlockFunction(_lockContext);
     }
+}
 
-    return execCommand("ATI9", DEFAULT_READ_MS, buffer, size);
+// Sets the functions that lock and unlock the modem when it is shared between threads.
+void Sodaq_N3X::setLock(LockFunction lock, LockFunction unlock, void* context)
+{
+    _lockFunction   = lock;
+    _unlockFunction = unlock;
+    _lockContext    = context;
 }
 
-// Gets International Mobile Equipment Identity.
-// Should be provided with a buffer of at least 16 bytes.
-// Returns true if successful.
-bool Sodaq_N3X::getIMEI(char* buffer, size_t size)
+// Sets the handler that is called for every unsolicited result code handled by the library.
+void Sodaq_N3X::setURCHandler(URCHandler handler, void* context)
 {
-    char responseBuffer[64];
+    _urcHandler        = handler;
+    _urcHandlerContext = context;
+}
 
-    if (buffer == NULL || size < 15 + 1) {
-        return false;
-    }
+// Sets the callback that is called repeatedly while the library waits for the modem.
+void Sodaq_N3X::setIdleCallback(IdleCallback callback, void* context)
+{
+    _idleCallback        = callback;
+    _idleCallbackContext = context;
+}
 
-    println("AT+CGSN=1");
+// Reads and handles the unsolicited result codes received from the modem, without
+// sending any command. Keeps listening for "timeout" ms, and as long as data is available.
+// Returns true if any unsolicited result code was handled.
+bool Sodaq_N3X::processURCs(uint32_t timeout)
+{
+    uint32_t from = (timeout > 0) ? beginWait() : NOW;
+    bool handled = false;
+    bool available;
 
-    memset(responseBuffer, 0, sizeof(responseBuffer));
+    do {
+        {
+            // The stream is only touched with the lock held, another thread may be reading
+            // a response from it.
+            Lock lock(this);
 
-    if ((readResponse(responseBuffer, sizeof(responseBuffer), "+CGSN: ") == GSMResponseOK) && (strlen(responseBuffer) > 0)) {
+            if (_modemStream->available() > 0 && readLn() > 0) {
+                debugPrint("<< ");
+                debugPrintln(_inputBuffer);
 
-        if (sscanf(responseBuffer, "\"%[^\"]\"", buffer) == 1) {
-            return true;
+                handled |= handleOperationLine(_inputBuffer) || checkURC(_inputBuffer);
+            }
+
+            available = _modemStream->available() > 0;
+        }
+
+        if (!available && timeout > 0) {
+            idle(timeout - min(NOW - from, timeout));
         }
+    } while (available || (timeout > 0 && !is_timedout(from, timeout)));
+
+    if (timeout > 0) {
+        endWait(from);
     }
 
-    return false;
+    deliverReceived();
+
+    return handled;
 }
 
-bool Sodaq_N3X::getOperatorInfo(uint16_t* mcc, uint16_t* mnc)
+// Disconnects the modem from the network.
+bool Sodaq_N3X::disconnect()
 {
-    uint32_t operatorCode = 0;
+    Lock lock(this);
+
+    return execCommand("AT+COPS=2", 40000);
+}
+
+
+/******************************************************************************
+* Public
+*****************************************************************************/
+
+bool Sodaq_N3X::attachGprs(uint32_t timeout)
+{
+    uint32_t start = millis();
+    uint32_t delay = 0;
+
+    for (uint8_t attempts = 1; ; attempts++) {
+        if (isDefinedIP4()) {
+            return true;
+        }
+
+        // Don't keep waiting for an attach that won't happen without a reboot.
+        if (getRebootReason() != RebootReasonNone) {
+            return false;
+        }
+
+        if (!retryWait(RetryLoopAttach, attempts, &delay, start, timeout)) {
+            return false;
+        }
+    }
+}
+
+// Gets Integrated Circuit Card ID.
+// Should be provided with a buffer of at least 21 bytes.
+// Returns true if successful.
+bool Sodaq_N3X::getCCID(char* buffer, size_t size)
+{
+    Lock lock(this);
+
+    if (buffer == NULL || size < 20 + 1) {
+        return false;
+    }
+
+    return getIdentityValue(buffer, size, _identity.ccid);
+}
+
+bool Sodaq_N3X::getCellId(uint16_t* tac, uint32_t* cid)
+{
+    Lock lock(this);
+
+    char responseBuffer[64];
+
+    println("AT+CEREG=2");
+
+    if (readResponse() != GSMResponseOK) {
+        return false;
+    }
+
+    println("AT+CEREG?");
+
+    memset(responseBuffer, 0, sizeof(responseBuffer));
+
+    if ((readResponse(responseBuffer, sizeof(responseBuffer), "+CEREG: ") == GSMResponseOK) && (strlen(responseBuffer) > 0)) {
+
+        if (sscanf(responseBuffer, "2,%*d,\"%hx\",\"%" SCNx32 "\",", tac, cid) == 2) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Sodaq_N3X::getEpoch(uint32_t* epoch)
+{
+    Lock lock(this);
+
+    char buffer[128];
+
+    println("AT+CCLK?");
+
+    if (readResponse(buffer, sizeof(buffer), "+CCLK: ") != GSMResponseOK) {
+        return false;
+    }
+
+    // format: "yy/MM/dd,hh:mm:ss+TZ
+    int y, m, d, h, min, sec, tz;
+    if (sscanf(buffer, "\"%u/%u/%u,%u:%u:%u+%u\"", &y, &m, &d, &h, &min, &sec, &tz) == 7 ||
+        sscanf(buffer, "\"%u/%u/%u,%u:%u:%u\"", &y, &m, &d, &h, &min, &sec) == 6)
+    {
+        *epoch = convertDatetimeToEpoch(y, m, d, h, min, sec);
+        return true;
+    }
+
+    return false;
+}
+
+bool Sodaq_N3X::getFirmwareVersion(char* buffer, size_t size)
+{
+    Lock lock(this);
+
+    if (buffer == NULL || size < 30 + 1) {
+        return false;
+    }
+
+    return getIdentityValue(buffer, size, _identity.firmwareVersion);
+}
+
+bool Sodaq_N3X::getFirmwareRevision(char* buffer, size_t size)
+{
+    Lock lock(this);
+
+    if (buffer == NULL || size < 30 + 1) {
+        return false;
+    }
+
+    return getIdentityValue(buffer, size, _identity.firmwareRevision);
+}
+
+// Gets International Mobile Equipment Identity.
+// Should be provided with a buffer of at least 16 bytes.
+// Returns true if successful.
+bool Sodaq_N3X::getIMEI(char* buffer, size_t size)
+{
+    Lock lock(this);
+
+    if (buffer == NULL || size < 15 + 1) {
+        return false;
+    }
+
+    return getIdentityValue(buffer, size, _identity.imei);
+}
+
+// Gets International Mobile Subscriber Identity.
+// Should be provided with a buffer of at least 16 bytes.
+// Returns true if successful.
+bool Sodaq_N3X::getIMSI(char* buffer, size_t size)
+{
+    Lock lock(this);
+
+    if (buffer == NULL || size < 15 + 1) {
+        return false;
+    }
+
+    return getIdentityValue(buffer, size, _identity.imsi);
+}
+
+bool Sodaq_N3X::getOperatorInfo(uint16_t* mcc, uint16_t* mnc)
+{
+    Lock lock(this);
+
+    uint32_t operatorCode = 0;
 
     char responseBuffer[64];
 
@@ -395,7 +1094,7 @@ bool Sodaq_N3X::getOperatorInfo(uint16_t* mcc, uint16_t* mnc)
 
     if ((readResponse(responseBuffer, sizeof(responseBuffer), "+COPS: ") == GSMResponseOK) && (strlen(responseBuffer) > 0)) {
 
-        if (sscanf(responseBuffer, "%*d,%*d,\"%lu\"", &operatorCode) == 1) {
+        if (sscanf(responseBuffer, "%*d,%*d,\"%" SCNu32 "\"", &operatorCode) == 1) {
             uint16_t divider = (operatorCode > 100000) ? 1000 : 100;
 
             *mcc = operatorCode / divider;
@@ -410,6 +1109,8 @@ bool Sodaq_N3X::getOperatorInfo(uint16_t* mcc, uint16_t* mnc)
 
 bool Sodaq_N3X::getOperatorInfoString(char* buffer, size_t size)
 {
+    Lock lock(this);
+
     char responseBuffer[64];
 
     if (size < 32 + 1) {
@@ -434,6 +1135,8 @@ bool Sodaq_N3X::getOperatorInfoString(char* buffer, size_t size)
 
 SimStatuses Sodaq_N3X::getSimStatus()
 {
+    Lock lock(this);
+
     char buffer[32];
 
     println("AT+CPIN?");
@@ -451,8 +1154,90 @@ SimStatuses Sodaq_N3X::getSimStatus()
     return SimMissing;
 }
 
+// Reads the IMEI and firmware version and revision in a single command, then the CCID
+// and IMSI, and keeps them for the getters.
+bool Sodaq_N3X::readIdentity(ModemIdentity* identity)
+{
+    Lock lock(this);
+
+    char buffer[128];
+    char* lines[3];
+    uint8_t count = 0;
+
+    // The responses come one line per command, in this order, followed by a single OK.
+    println("AT+CGSN=1;+CGMR;I9");
+
+    if (readResponse(buffer, sizeof(buffer), NULL) != GSMResponseOK) {
+        return false;
+    }
+
+    // Split the lines, which readResponse() joined with LF.
+    for (char* line = buffer; line != NULL && count < 3; ) {
+        lines[count++] = line;
+
+        if ((line = strchr(line, LF)) != NULL) {
+            *line++ = 0;
+        }
+    }
+
+    if (count != 3 || !STARTS_WITH(lines[0], "+CGSN: ")) {
+        return false;
+    }
+
+    ModemIdentity id;
+
+    memset(&id, 0, sizeof(id));
+
+    if (sscanf(lines[0] + STRLEN("+CGSN: "), "\"%15[^\"]\"", id.imei) != 1) {
+        return false;
+    }
+
+    copyIdentity(id.firmwareVersion,  sizeof(id.firmwareVersion),  lines[1]);
+    copyIdentity(id.firmwareRevision, sizeof(id.firmwareRevision), lines[2]);
+
+    // Separately, as they fail without a (ready) SIM. They are left empty then.
+    println("AT+CCID");
+    readResponse(id.ccid, sizeof(id.ccid), "+CCID: ");
+
+    execCommand("AT+CIMI", DEFAULT_READ_MS, id.imsi, sizeof(id.imsi));
+
+    _identity      = id;
+    _identityValid = true;
+
+    if (identity) {
+        *identity = _identity;
+    }
+
+    return true;
+}
+
+// Copies a value of the cached identity, after reading the identity if the value is not cached.
+// Returns true if the value is not empty.
+bool Sodaq_N3X::getIdentityValue(char* buffer, size_t size, const char* value)
+{
+    if (!_identityValid || value[0] == 0) {
+        readIdentity();
+    }
+
+    return _identityValid && copyIdentity(buffer, size, value);
+}
+
+// Keeps the cached identity after the modem was switched on, only if the SIM is the same.
+void Sodaq_N3X::checkIdentity()
+{
+    char ccid[sizeof(_identity.ccid)];
+
+    println("AT+CCID");
+
+    if (readResponse(ccid, sizeof(ccid), "+CCID: ") != GSMResponseOK || strcmp(ccid, _identity.ccid) != 0) {
+        _identityValid = false;
+    }
+}
+
 bool Sodaq_N3X::execCommand(const char* command, uint32_t timeout, char* buffer, size_t size)
 {
+    Lock lock(this);
+
     println(command);
 
     return (readResponse(buffer, size, NULL, timeout) == GSMResponseOK);
@@ -473,6 +1258,8 @@ bool Sodaq_N3X::isConnected()
 // Returns true if defined IP4 address is not 0.0.0.0.
 bool Sodaq_N3X::isDefinedIP4()
 {
+    Lock lock(this);
+
     char buffer[256];
 
     println("AT+CGDCONT?");
@@ -496,6 +1283,8 @@ bool Sodaq_N3X::isDefinedIP4()
 
 bool Sodaq_N3X::ping(const char* ip)
 {
+    Lock lock(this);
+
     print("AT+UPING=\"");
     print(ip);
     println('"');
@@ -503,8 +1292,76 @@ bool Sodaq_N3X::ping(const char* ip)
     return (readResponse() == GSMResponseOK);
 }
 
+// Sends "count" echo requests to the given host, and collects the replies from the
+// +UUPING and +UUPINGER unsolicited result codes.
+bool Sodaq_N3X::ping(const char* host, uint8_t count, PingStatistics* stats, uint16_t size,
+                     uint32_t timeout, uint8_t ttl)
+{
+    {
+        // Another thread may be handling the +UUPING of an earlier ping().
+        Lock lock(this);
+
+        memset(&_pingStatistics, 0, sizeof(_pingStatistics));
+        _pingStatistics.lastError = -1;
+        _pingRttSum    = 0;
+        _pingJitterSum = 0;
+        _pingLastRtt   = 0;
+
+        if (count == 0) {
+            return false;
+        }
+
+        print("AT+UPING=\"");
+        print(host);
+        print("\",");
+        print(count);
+        print(',');
+        print(size);
+        print(',');
+        print(timeout);
+        print(',');
+        println(ttl);
+
+        if (readResponse() != GSMResponseOK) {
+            return false;
+        }
+
+        _pingActive = true;
+    }
+
+    // The requests are sent one after the other, each waits for its reply or time out.
+    uint32_t start = millis();
+
+    while (_pingStatistics.received + _pingStatistics.lost < count &&
+            !is_timedout(start, count * timeout + UPING_MARGIN)) {
+        wait(10);
+    }
+
+    Lock lock(this);
+
+    _pingActive = false;
+    _pingStatistics.sent = count;
+    _pingStatistics.lost = count - _pingStatistics.received;
+
+    if (_pingStatistics.received > 0) {
+        _pingStatistics.avgRtt = _pingRttSum / _pingStatistics.received;
+    }
+
+    if (_pingStatistics.received > 1) {
+        _pingStatistics.jitter = _pingJitterSum / (_pingStatistics.received - 1);
+    }
+
+    if (stats) {
+        *stats = _pingStatistics;
+    }
+
+    return _pingStatistics.received > 0;
+}
+
 void Sodaq_N3X::purgeAllResponsesRead()
 {
+    Lock lock(this);
+
     uint32_t start = millis();
 
     // make sure all the responses within the timeout have been read
@@ -513,6 +1370,8 @@ void Sodaq_N3X::purgeAllResponsesRead()
 
 bool Sodaq_N3X::setApn(const char* apn)
 {
+    Lock lock(this);
+
     if (apn == NULL || apn[0] == 0) {
         return false;
     }
@@ -521,13 +1380,22 @@ bool Sodaq_N3X::setApn(const char* apn)
     print(_cid);
     print(",\"IP\",\"");
     print(apn);
-    println('"');
+
+    if (_headerCompression != HeaderCompressionOff) {
+        print("\",\"\",0,");
+        println(_headerCompression);
+    }
+    else {
+        println('"');
+    }
 
     return (readResponse() == GSMResponseOK);
 }
 
 bool Sodaq_N3X::setBandSel(const char* bandSel)
 {
+    Lock lock(this);
+
     if (bandSel == NULL || bandSel == NULL) {
         return false;
     }
@@ -540,6 +1408,8 @@ bool Sodaq_N3X::setBandSel(const char* bandSel)
 
 bool Sodaq_N3X::setDefaultApn(const char* apn)
 {
+    Lock lock(this);
+
     char buffer[100];
     int pdp_type;
     char default_apn[80];
@@ -586,6 +1456,13 @@ bool Sodaq_N3X::setDefaultApn(const char* apn)
 
 bool Sodaq_N3X::setOperator(const char* opr)
 {
+    return setOperator(opr, COPS_TIMEOUT);
+}
+
+bool Sodaq_N3X::setOperator(const char* opr, uint32_t timeout)
+{
+    Lock lock(this);
+
     if (opr == NULL || opr[0] == 0) {
         debugPrintln("Skipping empty operator");
         return true;
@@ -600,11 +1477,20 @@ bool Sodaq_N3X::setOperator(const char* opr)
         println('"');
     }
 
-    return (readResponse(NULL, 0, NULL, COPS_TIMEOUT) == GSMResponseOK);
+    GSMResponseTypes response = readResponse(NULL, 0, NULL, timeout);
+
+    // The modem is still searching, stop it before the next command is sent.
+    if (response == GSMResponseTimeout) {
+        abortCommand();
+    }
+
+    return (response == GSMResponseOK);
 }
 
 bool Sodaq_N3X::setRadioActive(bool on)
 {
+    Lock lock(this);
+
     print("AT+CFUN=");
     println(on ? '1' : '0');
 
@@ -613,6 +1499,8 @@ bool Sodaq_N3X::setRadioActive(bool on)
 
 bool Sodaq_N3X::setVerboseErrors(bool on)
 {
+    Lock lock(this);
+
     print("AT+CMEE=");
     println(on ? '1' : '0');
 
@@ -621,41 +1509,125 @@ bool Sodaq_N3X::setVerboseErrors(bool on)
 
 
 /******************************************************************************
-* RSSI and CSQ
+* Statistics
 *****************************************************************************/
 
-/*
-    The range is the following:
-    0: -113 dBm or less
-    1: -111 dBm
-    2..30: from -109 to -53 dBm with 2 dBm steps
-    31: -51 dBm or greater
-    99: not known or not detectable or currently not available
-*/
-int8_t Sodaq_N3X::convertCSQ2RSSI(uint8_t csq) const
+// Returns a score from 0 (unusable) to 100 (good), based on the last RSSI and
+// the share of commands that failed or timed out.
+uint8_t Sodaq_N3X::getHealthScore() const
 {
-    return -113 + 2 * csq;
+    // Unknown signal quality counts as mediocre, not as bad.
+    uint32_t rssiScore = 50;
+
+    if (_lastRSSI != 0) {
+        rssiScore = constrain(_lastRSSI + 113, 0, 60) * 100 / 60;
+    }
+
+    if (_commandCount == 0) {
+        return rssiScore;
+    }
+
+    uint32_t failed = min(_errorCount + _timeoutCount, _commandCount);
+
+    return rssiScore * (_commandCount - failed) / _commandCount;
 }
 
-uint8_t Sodaq_N3X::convertRSSI2CSQ(int8_t rssi) const
+void Sodaq_N3X::resetCommandStatistics()
 {
-    return (rssi + 113) / 2;
+    _commandCount = 0;
+    _errorCount   = 0;
+    _timeoutCount = 0;
 }
 
-// Gets the Received Signal Strength Indication in dBm and Bit Error Rate.
-// Returns true if successful.
-bool Sodaq_N3X::getRSSIAndBER(int8_t* rssi, uint8_t* ber)
+void Sodaq_N3X::resetWaitStatistics()
 {
-    static char berValues[] = { 49, 43, 37, 25, 19, 13, 7, 0 }; // 3GPP TS 45.008 [20] subclause 8.2.4
+    _waitTime = 0;
+    _idleTime = 0;
+}
 
-    char buffer[256];
-    int csqRaw;
-    int berRaw;
 
-    println("AT+CSQ");
+/******************************************************************************
+* Energy
+*****************************************************************************/
 
-    if (readResponse(buffer, sizeof(buffer), "+CSQ: ") != GSMResponseOK) {
-        return false;
+// Gets the time spent in each power state, and the estimated charge used.
+void Sodaq_N3X::getEnergyStatistics(EnergyStatistics* stats)
+{
+    // Account for the time spent in the current state so far.
+    setPowerState(_powerState);
+
+    // uA * ms / (1000 * 3600 * 1000) = mAh
+    float charge = 0;
+
+    for (uint8_t i = 0; i < PowerStateCount; i++) {
+        stats->stateTime[i] = _stateTime[i];
+        charge += (float)_stateTime[i] * _stateCurrent[i];
+    }
+
+    stats->commandTime      = _commandTime;
+    stats->messagesSent     = _messagesSent;
+    stats->charge           = charge / 3600000000.0f;
+    stats->chargePerMessage = (_messagesSent > 0) ? stats->charge / _messagesSent : 0;
+}
+
+void Sodaq_N3X::resetEnergyStatistics()
+{
+    memset(_stateTime, 0, sizeof(_stateTime));
+
+    _powerStateSince = millis();
+    _commandTime     = 0;
+    _messagesSent    = 0;
+}
+
+// Adds the time spent in the previous power state and switches to the given state.
+void Sodaq_N3X::setPowerState(PowerStates state)
+{
+    uint32_t now = millis();
+
+    _stateTime[_powerState] += now - _powerStateSince;
+    _powerStateSince = now;
+    _powerState = state;
+}
+
+
+/******************************************************************************
+* RSSI and CSQ
+*****************************************************************************/
+
+/*
+    The range is the following:
+    0: -113 dBm or less
+    1: -111 dBm
+    2..30: from -109 to -53 dBm with 2 dBm steps
+    31: -51 dBm or greater
+    99: not known or not detectable or currently not available
+*/
+int8_t Sodaq_N3X::convertCSQ2RSSI(uint8_t csq) const
+{
+    return -113 + 2 * csq;
+}
+
+uint8_t Sodaq_N3X::convertRSSI2CSQ(int8_t rssi) const
+{
+    return (rssi + 113) / 2;
+}
+
+// Gets the Received Signal Strength Indication in dBm and Bit Error Rate.
+// Returns true if successful.
+bool Sodaq_N3X::getRSSIAndBER(int8_t* rssi, uint8_t* ber)
+{
+    Lock lock(this);
+
+    static char berValues[] = { 49, 43, 37, 25, 19, 13, 7, 0 }; // 3GPP TS 45.008 [20] subclause 8.2.4
+
+    char buffer[256];
+    int csqRaw;
+    int berRaw;
+
+    println("AT+CSQ");
+
+    if (readResponse(buffer, sizeof(buffer), "+CSQ: ") != GSMResponseOK) {
+        return false;
     }
 
     if (sscanf(buffer, "%d,%d", &csqRaw, &berRaw) != 2) {
@@ -665,6 +1637,130 @@ bool Sodaq_N3X::getRSSIAndBER(int8_t* rssi, uint8_t* ber)
     *rssi = ((csqRaw == 99) ? 0 : convertCSQ2RSSI(csqRaw));
     *ber  = ((berRaw == 99 || static_cast<size_t>(berRaw) >= sizeof(berValues)) ? 0 : berValues[berRaw]);
 
+    addSignalSample(*rssi, *ber);
+
+    return true;
+}
+
+// Gets the signal quality model, sending AT+CSQ only when the last sample is stale.
+bool Sodaq_N3X::getSignalQuality(SignalQuality* quality)
+{
+    int8_t rssi;
+    uint8_t ber;
+
+    if (!isSignalSampleFresh() && !getRSSIAndBER(&rssi, &ber)) {
+        return false;
+    }
+
+    if (quality) {
+        *quality     = _signalQuality;
+        quality->age = millis() - _signalSampleTime;
+    }
+
+    return true;
+}
+
+// Adds a sample to the signal quality model.
+void Sodaq_N3X::addSignalSample(int8_t rssi, uint8_t ber)
+{
+    _signalQuality.rssi = rssi;
+    _signalQuality.ber  = ber;
+    _signalSampleTime   = millis();
+
+    if (rssi == 0) {
+        return;
+    }
+
+    _lastRSSI = rssi;
+
+    if (_signalQuality.samples == 0) {
+        _signalQuality.averageRSSI  = rssi;
+        _signalQuality.varianceRSSI = 0;
+        _signalQuality.averageBER   = ber;
+    }
+    else {
+        // Exponentially weighted mean and variance.
+        float diff = rssi - _signalQuality.averageRSSI;
+        float incr = SIGNAL_QUALITY_WEIGHT * diff;
+
+        _signalQuality.averageRSSI  += incr;
+        _signalQuality.varianceRSSI  = (1 - SIGNAL_QUALITY_WEIGHT) * (_signalQuality.varianceRSSI + diff * incr);
+        _signalQuality.averageBER   += SIGNAL_QUALITY_WEIGHT * (ber - _signalQuality.averageBER);
+    }
+
+    _signalQuality.samples++;
+}
+
+// Returns true if the last signal quality sample is younger than the TTL.
+bool Sodaq_N3X::isSignalSampleFresh() const
+{
+    return _signalTTL > 0 && _signalSampleTime != 0 && !is_timedout(_signalSampleTime, _signalTTL);
+}
+
+
+/******************************************************************************
+* Firmware update
+*****************************************************************************/
+
+// Sets the handler that is called when the firmware update status changes.
+void Sodaq_N3X::setFOTAHandler(FOTAHandler handler, void* context)
+{
+    _fotaHandler        = handler;
+    _fotaHandlerContext = context;
+}
+
+// Tracks the firmware update status reported by +UFOTAS.
+void Sodaq_N3X::setFOTAStatus(FOTAStatuses status, uint16_t blocksRemaining)
+{
+    bool changed = (status != _fotaStatus) || (status == FOTAStatusDownloading);
+
+    // The update was installed when the modem is idle again after the download.
+    // The restart closed the sockets and the data connection, and changed the firmware version.
+    if (status == FOTAStatusIdle && _fotaStatus == FOTAStatusDownloaded) {
+        _fotaReconnect    = true;
+        _identityValid    = false;
+        _signalSampleTime = 0;
+        _hexModeSet       = false;
+
+        memset(_socketClosedBit,    1, sizeof(_socketClosedBit));
+        memset(_socketPendingBytes, 0, sizeof(_socketPendingBytes));
+    }
+
+    _fotaStatus = status;
+
+    if (_fotaHandler && changed) {
+        _fotaHandler(status, blocksRemaining, _fotaHandlerContext);
+    }
+}
+
+// Ends the firmware update in progress when the modem restarts, in case the +UFOTAS that
+// reports its end is missed. A downloaded update is installed by the restart.
+void Sodaq_N3X::resetFOTAStatus()
+{
+    if (_fotaStatus != FOTAStatusIdle) {
+        setFOTAStatus(FOTAStatusIdle, 0);
+    }
+}
+
+// Waits up to the FOTA wait timeout for a firmware update in progress, and connects again
+// after an update. Returns false if the modem is not ready to send.
+bool Sodaq_N3X::checkFOTA()
+{
+    uint32_t start = millis();
+
+    while (_fotaWaitTimeout > 0 && isFOTAInProgress() && !is_timedout(start, _fotaWaitTimeout)) {
+        wait(100);
+    }
+
+    if (isFOTAInProgress()) {
+        debugPrintln("Firmware update in progress");
+        return false;
+    }
+
+    if (_fotaReconnect && _connectApn[0] != 0) {
+        return connect(_connectApn, _connectOperator, (_connectBandSel[0] != 0) ? _connectBandSel : NULL);
+    }
+
     return true;
 }
 
@@ -675,6 +1771,8 @@ bool Sodaq_N3X::getRSSIAndBER(int8_t* rssi, uint8_t* ber)
 
 bool Sodaq_N3X::socketClose(uint8_t socketID, bool async)
 {
+    Lock lock(this);
+
     print("AT+USOCL=");
     print(socketID);
 
@@ -693,6 +1791,8 @@ bool Sodaq_N3X::socketClose(uint8_t socketID, bool async)
 
 int Sodaq_N3X::socketCloseAll() {
 
+    Lock lock(this);
+
     int closedCount = 0;
 
     for (uint8_t i = 0; i < SOCKET_COUNT; i++) {
@@ -707,6 +1807,8 @@ int Sodaq_N3X::socketCloseAll() {
 
 bool Sodaq_N3X::socketConnect(uint8_t socketID, const char* remoteHost, const uint16_t remotePort)
 {
+    Lock lock(this);
+
     bool b;
 
     print("AT+USOCO=");
@@ -725,6 +1827,8 @@ bool Sodaq_N3X::socketConnect(uint8_t socketID, const char* remoteHost, const ui
 
 int Sodaq_N3X::socketCreate(uint16_t localPort, Protocols protocol)
 {
+    Lock lock(this);
+
     char buffer[32];
     int socketID;
 
@@ -743,12 +1847,13 @@ int Sodaq_N3X::socketCreate(uint16_t localPort, Protocols protocol)
         return SOCKET_FAIL;
     }
 
-    if ((sscanf(buffer, "%d", &socketID) != 1) || (socketID < 0) || (socketID > SOCKET_COUNT)) {
+    if ((sscanf(buffer, "%d", &socketID) != 1) || (socketID < 0) || (socketID >= SOCKET_COUNT)) {
         return SOCKET_FAIL;
     }
 
     _socketClosedBit   [socketID] = true;
     _socketPendingBytes[socketID] = 0;
+    socketResetStatistics(socketID);
 
     return socketID;
 }
@@ -763,6 +1868,26 @@ bool Sodaq_N3X::socketHasPendingBytes(uint8_t socketID)
     return _socketPendingBytes[socketID] > 0;
 }
 
+// Gets the traffic counters of the socket, since it was created.
+// Returns true if successful.
+bool Sodaq_N3X::socketGetStatistics(uint8_t socketID, SocketStatistics* stats)
+{
+    if (socketID >= SOCKET_COUNT || stats == NULL) {
+        return false;
+    }
+
+    *stats = _socketStatistics[socketID];
+
+    return true;
+}
+
+void Sodaq_N3X::socketResetStatistics(uint8_t socketID)
+{
+    if (socketID < SOCKET_COUNT) {
+        memset(&_socketStatistics[socketID], 0, sizeof(_socketStatistics[socketID]));
+    }
+}
+
 bool Sodaq_N3X::socketIsClosed(uint8_t socketID)
 {
     return _socketClosedBit[socketID];
@@ -770,217 +1895,990 @@ bool Sodaq_N3X::socketIsClosed(uint8_t socketID)
 
 size_t Sodaq_N3X::socketReceive(uint8_t socketID, uint8_t* buffer, size_t size)
 {
-    char   outBuffer[SODAQ_N3X_MAX_UDP_BUFFER];
-    int    retSocketID;
-    size_t retSize;
+    Lock lock(this);
 
-    if (!socketHasPendingBytes(socketID)) {
+    if (socketID >= SOCKET_COUNT || !socketHasPendingBytes(socketID)) {
         // no URC has happened, no socket to read
         debugPrintln("Reading from without available bytes!");
         return 0;
     }
 
-    size = min(size, min(SODAQ_N3X_MAX_UDP_BUFFER, _socketPendingBytes[socketID]));
-
-    print("AT+USORF=");
-    println(socketID);
+    int length = socketReadDatagram(socketID, buffer, size, NULL, NULL);
 
-    if (readResponse(outBuffer, sizeof(outBuffer)) != GSMResponseOK) {
+    if (length <= 0) {
         return 0;
     }
 
-    if (sscanf(outBuffer, "+USORF: %d,\"%*[^\"]\",%*d,%d,\"%[^\"]\"", &retSocketID, &retSize, outBuffer) != 3) {
-        return 0;
-    }
+    return (buffer != NULL) ? min((size_t)length, size) : length;
+}
 
-    if ((retSocketID < 0) || (retSocketID >= SOCKET_COUNT)) {
+// Reads the pending datagrams of the socket into the slots, then corrects the pending bytes.
+size_t Sodaq_N3X::socketReceiveBatch(uint8_t socketID, ReceiveSlot* slots, size_t count)
+{
+    Lock lock(this);
+
+    size_t received = 0;
+
+    if (socketID >= SOCKET_COUNT || slots == NULL) {
         return 0;
     }
 
-    _socketPendingBytes[socketID] -= retSize;
+    while (received < count) {
+        while (received < count && socketHasPendingBytes(socketID)) {
+            ReceiveSlot& slot = slots[received];
 
-    if (buffer != NULL && size > 0) {
-        for (size_t i = 0; i < retSize * 2; i += 2) {
-            buffer[i / 2] = HEX_PAIR_TO_BYTE(outBuffer[i], outBuffer[i + 1]);
+            int length = socketReadDatagram(socketID, slot.buffer, slot.size, slot.remoteIP, &slot.remotePort);
+
+            if (length <= 0) {
+                break;
+            }
+
+            slot.length = length;
+            received++;
+        }
+
+        // The +UUSORF sizes may not add up, e.g. after a missed or merged URC. Ask the modem,
+        // and continue if it still has data.
+        size_t before = _socketPendingBytes[socketID];
+
+        if (!socketReadPendingBytes(socketID) || !socketHasPendingBytes(socketID) ||
+                _socketPendingBytes[socketID] == before) {
+            break;
         }
     }
 
-    return retSize;
+    return received;
 }
 
 size_t Sodaq_N3X::socketSend(uint8_t socketID, const char* remoteHost, const uint16_t remotePort, const uint8_t* buffer, size_t size)
 {
-    char outBuffer[64];
-    int retSocketID;
-    int sentLength;
+    if (socketID >= SOCKET_COUNT) {
+        return 0;
+    }
+
+    // Checked before taking the lock, as it may wait for a firmware update to finish.
+    if (!checkFOTA()) {
+        return 0;
+    }
+
+    Lock lock(this);
 
     if (size > SODAQ_MAX_SEND_MESSAGE_SIZE) {
         debugPrintln("Message exceeded maximum size!");
         return 0;
     }
 
-    execCommand("AT+UDCONF=1,1");
+    if (!setHexMode()) {
+        _socketStatistics[socketID].sendErrors++;
+        return 0;
+    }
 
-    print("AT+USOST=");
-    print(socketID);
-    print(",\"");
-    print(remoteHost);
-    print("\",");
-    print(remotePort);
-    print(',');
-    print(size);
-    print(",\"");
+    writeSocketSend(socketID, remoteHost, remotePort, buffer, size);
+
+    return readSocketSendResponse(socketID);
+}
+
+// Starts a datagram that is written with the payload's print() methods, and sent by payload.end().
+bool Sodaq_N3X::beginPayload(Sodaq_N3X_Payload& payload, uint8_t socketID, const char* remoteHost,
+                             const uint16_t remotePort, size_t length)
+{
+    if (payload._modem != NULL) {
+        return false;
+    }
+
+    // Until it is started, end() must not take it for a payload that is only counted.
+    payload._ended = true;
+
+    if (socketID >= SOCKET_COUNT || length == 0) {
+        return false;
+    }
+
+    if (length > SODAQ_MAX_SEND_MESSAGE_SIZE) {
+        debugPrintln("Message exceeded maximum size!");
+        return false;
+    }
+
+    // Checked before taking the lock, as it may wait for a firmware update to finish.
+    if (!checkFOTA()) {
+        return false;
+    }
+
+    // Held until the payload is sent.
+    lock();
 
-    for (size_t i = 0; i < size; ++i) {
-        print(static_cast<char>(NIBBLE_TO_HEX_CHAR(HIGH_NIBBLE(buffer[i]))));
-        print(static_cast<char>(NIBBLE_TO_HEX_CHAR(LOW_NIBBLE(buffer[i]))));
+    if (!setHexMode()) {
+        unlock();
+        return false;
     }
 
+    writeSocketSendHeader(socketID, remoteHost, remotePort, length);
+
+    payload._modem    = this;
+    payload._socketID = socketID;
+    payload._size     = length;
+    payload._length   = 0;
+    payload._ended    = false;
+
+    return true;
+}
+
+// Sends the payload and releases the lock taken by beginPayload().
+// A payload shorter than its length is not sent, and returns 0.
+size_t Sodaq_N3X::endPayload(Sodaq_N3X_Payload& payload)
+{
     println('"');
 
-    if (readResponse(outBuffer, sizeof(outBuffer), "+USOST: ", SOCKET_WRITE_TIMEOUT) != GSMResponseOK) {
+    size_t sentLength;
+
+    if (payload._length < payload._size) {
+        debugPrint("Payload incomplete: ");
+        debugPrint(payload._length);
+        debugPrint(" of ");
+        debugPrintln(payload._size);
+
+        // The modem rejects the command as the data doesn't match the length, only read the result.
+        readResponse(NULL, 0, NULL, _socketWriteTimeout);
+        _socketStatistics[payload._socketID].sendErrors++;
+        sentLength = 0;
+    }
+    else {
+        sentLength = readSocketSendResponse(payload._socketID);
+    }
+
+    unlock();
+
+    return sentLength;
+}
+
+// Reads the response to AT+USOST, and returns the number of bytes sent, or 0 if that failed.
+size_t Sodaq_N3X::readSocketSendResponse(uint8_t socketID)
+{
+    char outBuffer[64];
+    int retSocketID;
+    int sentLength;
+
+    if (readResponse(outBuffer, sizeof(outBuffer), STR_RESPONSE_USOST, _socketWriteTimeout) != GSMResponseOK) {
+        _socketStatistics[socketID].sendErrors++;
         return 0;
     }
 
-    if ((sscanf(outBuffer, "%d,%d", &retSocketID, &sentLength) != 2) || (retSocketID < 0) || (retSocketID > SOCKET_COUNT)) {
+    if ((sscanf(outBuffer, "%d,%d", &retSocketID, &sentLength) != 2) || (retSocketID < 0) || (retSocketID >= SOCKET_COUNT)) {
+        _socketStatistics[socketID].sendErrors++;
         return 0;
     }
 
+    _socketStatistics[socketID].datagramsSent++;
+    _socketStatistics[socketID].bytesSent += sentLength;
+    _messagesSent++;
+
     return sentLength;
 }
 
-bool Sodaq_N3X::socketWaitForReceive(uint8_t socketID, uint32_t timeout)
+// Reads the next datagram of the socket, at most "size" bytes of it into the buffer.
+// Or, with "deliver", decodes it in place and passes it to the receive handler of the socket.
+// The response is parsed in the input buffer, it is not copied.
+// Returns the length of the datagram, or -1 if that failed.
+int Sodaq_N3X::socketReadDatagram(uint8_t socketID, uint8_t* buffer, size_t size, char* remoteIP, uint16_t* remotePort,
+                                  bool deliver)
 {
-    uint32_t startTime;
+    char* line;
+    char  ip[16];
+    int   retSocketID;
+    int   retPort;
+    int   retSize;
+    int   dataStart = 0;
 
-    if (socketHasPendingBytes(socketID)) {
-        return true;
+    // The response has to fit in the input buffer, so no more is read than that allows.
+    size_t reserve = USORF_OVERHEAD + (deliver ? USORF_RESULT_RESERVE : 0);
+
+    if (_inputBufferSize < reserve + 2) {
+        return -1;
     }
 
-    startTime = millis();
+    size_t length = min((size_t)SODAQ_N3X_MAX_UDP_BUFFER, (_inputBufferSize - reserve) / 2);
+
+    // Nor more than is pending, or than the caller can store. The rest stays pending.
+    if (_socketPendingBytes[socketID] > 0) {
+        length = min(length, _socketPendingBytes[socketID]);
+    }
+
+    if (buffer != NULL && size > 0) {
+        length = min(length, size);
+    }
+
+    if (!setHexMode()) {
+        return -1;
+    }
+
+    print("AT+USORF=");
+    print(socketID);
+    print(',');
+    println(length);
+
+    if (readResponse(NULL, 0, "+USORF: ", DEFAULT_READ_MS, &line) != GSMResponseOK || line == NULL) {
+        return -1;
+    }
+
+    // <socket>,"<remote_ip_addr>",<remote_port>,<length>,"<data>"
+    if (sscanf(line, "%d,\"%15[^\"]\",%d,%d,\"%n", &retSocketID, ip, &retPort, &retSize, &dataStart) != 4 ||
+            dataStart == 0 || retSocketID != socketID || retSize < 0) {
+        readResponse();
+        return -1;
+    }
+
+    const char* data = line + dataStart;
+    size_t count = min((size_t)retSize, strcspn(data, "\"") / 2);
+    uint8_t* view = NULL;
+    GSMResponseTypes response;
+
+    if (buffer != NULL && size > 0) {
+        {
+            profileScope(ProfileHexDecode);
+
+            count = min(count, size);
+
+            for (size_t i = 0; i < count; i++) {
+                buffer[i] = HEX_PAIR_TO_BYTE(data[2 * i], data[2 * i + 1]);
+            }
+        }
+
+        response = readResponse();
+    }
+    else if (deliver && _receiveHandlers[socketID] != NULL) {
+        // Each byte is written before the hex pair it is decoded from.
+        view = reinterpret_cast<uint8_t*>(line + dataStart);
+
+        {
+            profileScope(ProfileHexDecode);
+
+            for (size_t i = 0; i < count; i++) {
+                view[i] = HEX_PAIR_TO_BYTE(data[2 * i], data[2 * i + 1]);
+            }
+        }
+
+        // The final result code is read behind the decoded data, which stays in the input buffer.
+        size_t used = (view + count) - reinterpret_cast<uint8_t*>(_inputBuffer);
+        char* inputBuffer = _inputBuffer;
+        size_t inputBufferSize = _inputBufferSize;
+
+        _inputBuffer     += used;
+        _inputBufferSize -= used;
+
+        response = readResponse();
+
+        _inputBuffer     = inputBuffer;
+        _inputBufferSize = inputBufferSize;
+    }
+    else {
+        response = readResponse();
+    }
+
+    if (response != GSMResponseOK) {
+        return -1;
+    }
+
+    _socketPendingBytes[socketID] -= min(_socketPendingBytes[socketID], (size_t)retSize);
+
+    _socketStatistics[socketID].datagramsReceived++;
+    _socketStatistics[socketID].bytesReceived += retSize;
+
+    if (view != NULL) {
+        _receiveHandlers[socketID](socketID, view, count, ip, retPort, _receiveHandlerContexts[socketID]);
+    }
+
+    if (remoteIP) {
+        strcpy(remoteIP, ip);
+    }
+
+    if (remotePort) {
+        *remotePort = retPort;
+    }
+
+    return retSize;
+}
+
+// Sets the handler that is called with each datagram received on the socket.
+void Sodaq_N3X::socketSetReceiveHandler(uint8_t socketID, ReceiveHandler handler, void* context)
+{
+    if (socketID >= SOCKET_COUNT) {
+        return;
+    }
+
+    _receiveHandlers[socketID]        = handler;
+    _receiveHandlerContexts[socketID] = context;
+}
+
+// Reads the pending datagrams of the sockets with a receive handler, and passes them to it.
+// Not while a command is in progress, nor from within a receive handler.
+void Sodaq_N3X::deliverReceived()
+{
+    Lock lock(this);
+
+    if (_delivering || isCommandInProgress()) {
+        return;
+    }
+
+    _delivering = true;
+
+    for (uint8_t socketID = 0; socketID < SOCKET_COUNT; socketID++) {
+        while (_receiveHandlers[socketID] != NULL && socketHasPendingBytes(socketID)) {
+            if (socketReadDatagram(socketID, NULL, 0, NULL, NULL, true) < 0) {
+                // Try again later, with the number of bytes the modem still has.
+                socketReadPendingBytes(socketID);
+                break;
+            }
+        }
+    }
+
+    _delivering = false;
+}
+
+// Reads the number of bytes the modem has for the socket, and corrects the pending bytes.
+bool Sodaq_N3X::socketReadPendingBytes(uint8_t socketID)
+{
+    char outBuffer[32];
+    int  retSocketID;
+    int  length;
+
+    print("AT+USORF=");
+    print(socketID);
+    println(",0");
+
+    // <socket>,<length>
+    if (readResponse(outBuffer, sizeof(outBuffer), "+USORF: ") != GSMResponseOK) {
+        return false;
+    }
+
+    if (sscanf(outBuffer, "%d,%d", &retSocketID, &length) != 2 || retSocketID != socketID || length < 0) {
+        return false;
+    }
+
+    _socketPendingBytes[socketID] = length;
+
+    return true;
+}
+
+// Sends the AT+USOST command with the hex encoded datagram, without reading the response.
+void Sodaq_N3X::writeSocketSend(uint8_t socketID, const char* remoteHost, uint16_t remotePort,
+                                const uint8_t* buffer, size_t size)
+{
+    writeSocketSendHeader(socketID, remoteHost, remotePort, size);
+
+    {
+        profileScope(ProfileHexEncode);
+
+        for (size_t i = 0; i < size; ++i) {
+            writeHexByte(buffer[i]);
+        }
+    }
+
+    println('"');
+}
+
+// Sends the AT+USOST command up to the opening quote of the hex encoded data.
+void Sodaq_N3X::writeSocketSendHeader(uint8_t socketID, const char* remoteHost, uint16_t remotePort, size_t size)
+{
+    print("AT+USOST=");
+    print(socketID);
+    print(",\"");
+    print(remoteHost);
+    print("\",");
+    print(remotePort);
+    print(',');
+    print(size);
+    print(",\"");
+}
+
+// Writes a byte of socket data, hex encoded.
+void Sodaq_N3X::writeHexByte(uint8_t value)
+{
+    print(static_cast<char>(NIBBLE_TO_HEX_CHAR(HIGH_NIBBLE(value))));
+    print(static_cast<char>(NIBBLE_TO_HEX_CHAR(LOW_NIBBLE(value))));
+}
+
+bool Sodaq_N3X::socketWaitForReceive(uint8_t socketID, uint32_t timeout)
+{
+    uint32_t startTime;
+
+    if (socketHasPendingBytes(socketID)) {
+        return true;
+    }
+
+    startTime = millis();
+
+    // The +UUSORF URC is handled while waiting, no need to poll the modem.
+    while (!socketHasPendingBytes(socketID) && (millis() - startTime) < timeout) {
+        wait(10);
+    }
+
+    return socketHasPendingBytes(socketID);
+}
+
+
+/******************************************************************************
+* Asynchronous sockets
+*****************************************************************************/
+
+// Queues a datagram to send, and returns the handle of the operation, or -1 if that failed.
+int8_t Sodaq_N3X::socketSendAsync(uint8_t socketID, const char* remoteHost, const uint16_t remotePort,
+                                  const uint8_t* buffer, size_t size, uint32_t timeout,
+                                  AsyncCallback callback, void* context)
+{
+    if (size > SODAQ_MAX_SEND_MESSAGE_SIZE || remoteHost == NULL ||
+            strlen(remoteHost) >= sizeof(_operations[0].remoteHost)) {
+        return -1;
+    }
+
+    Lock lock(this);
+
+    if (isFOTAInProgress()) {
+        return -1;
+    }
+
+    int8_t handle = queueOperation(socketID, const_cast<uint8_t*>(buffer), size,
+                                   (timeout > 0) ? timeout : _socketWriteTimeout, callback, context);
+
+    if (handle >= 0) {
+        SocketOperation& op = _operations[handle];
+
+        op.isSend     = true;
+        op.remotePort = remotePort;
+        strcpy(op.remoteHost, remoteHost);
+    }
+
+    return handle;
+}
+
+// Queues a read of the next datagram received on the socket, and returns the handle of
+// the operation, or -1 if that failed.
+int8_t Sodaq_N3X::socketReceiveAsync(uint8_t socketID, uint8_t* buffer, size_t size, uint32_t timeout,
+                                     AsyncCallback callback, void* context)
+{
+    Lock lock(this);
+
+    return queueOperation(socketID, buffer, size, timeout, callback, context);
+}
+
+// Returns the status of an operation without callback. Frees the handle once the operation completed.
+AsyncStatuses Sodaq_N3X::socketAsyncStatus(int8_t handle, size_t* length, int* error)
+{
+    if (handle < 0 || handle >= SOCKET_OPERATION_COUNT) {
+        return AsyncStatusFree;
+    }
+
+    Lock lock(this);
+
+    SocketOperation& op = _operations[handle];
+    AsyncStatuses status = op.status;
+
+    if (length) {
+        *length = op.length;
+    }
+
+    if (error) {
+        *error = op.error;
+    }
+
+    if (status >= AsyncStatusDone) {
+        op.status = AsyncStatusFree;
+    }
+
+    return status;
+}
+
+// Drives the asynchronous socket operations and calls their callbacks.
+void Sodaq_N3X::process()
+{
+    // Handles the result of the command in progress too.
+    processURCs();
+
+    // The completed operations with a callback, which is called without the lock.
+    SocketOperation completed[SOCKET_OPERATION_COUNT];
+    int8_t handles[SOCKET_OPERATION_COUNT];
+    uint8_t count = 0;
+
+    {
+        Lock lock(this);
+
+        for (int8_t i = 0; i < SOCKET_OPERATION_COUNT; i++) {
+            SocketOperation& op = _operations[i];
+
+            if ((op.status == AsyncStatusQueued || op.status == AsyncStatusActive) && is_timedout(op.start, op.timeout)) {
+                completeOperation(i, AsyncStatusTimedOut);
+            }
+        }
+
+        startOperations();
+
+        for (int8_t i = 0; i < SOCKET_OPERATION_COUNT; i++) {
+            SocketOperation& op = _operations[i];
+
+            if (op.status >= AsyncStatusDone && op.callback != NULL) {
+                completed[count] = op;
+                handles[count++] = i;
+
+                // Free the handle first, the callback may queue the next operation.
+                op.status = AsyncStatusFree;
+            }
+        }
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        const SocketOperation& op = completed[i];
+
+        op.callback(handles[i], op.status, op.length, op.error, op.context);
+    }
+}
+
+// Takes a free operation handle, or returns -1 if there is none.
+int8_t Sodaq_N3X::queueOperation(uint8_t socketID, uint8_t* buffer, size_t size, uint32_t timeout,
+                                 AsyncCallback callback, void* context)
+{
+    if (socketID >= SOCKET_COUNT || buffer == NULL) {
+        return -1;
+    }
+
+    for (int8_t i = 0; i < SOCKET_OPERATION_COUNT; i++) {
+        SocketOperation& op = _operations[i];
+
+        if (op.status == AsyncStatusFree) {
+            memset(&op, 0, sizeof(op));
+
+            op.status   = AsyncStatusQueued;
+            op.socketID = socketID;
+            op.buffer   = buffer;
+            op.size     = size;
+            op.error    = -1;
+            op.start    = millis();
+            op.timeout  = timeout;
+            op.callback = callback;
+            op.context  = context;
+
+            return i;
+        }
+    }
+
+    debugPrintln("No free socket operation");
+
+    return -1;
+}
+
+// Reads the datagrams that arrived for the queued receive operations, and sends the next
+// queued datagram if no command is in progress.
+void Sodaq_N3X::startOperations()
+{
+    Lock lock(this);
+
+    if (isCommandInProgress()) {
+        return;
+    }
+
+    for (int8_t i = 0; i < SOCKET_OPERATION_COUNT; i++) {
+        SocketOperation& op = _operations[i];
+
+        if (op.status != AsyncStatusQueued || op.isSend || !socketHasPendingBytes(op.socketID)) {
+            continue;
+        }
+
+        // The datagram is already in the modem, reading it does not take long.
+        op.length = socketReceive(op.socketID, op.buffer, op.size);
+        completeOperation(i, (op.length > 0) ? AsyncStatusDone : AsyncStatusFailed);
+    }
+
+    for (int8_t i = 0; i < SOCKET_OPERATION_COUNT; i++) {
+        SocketOperation& op = _operations[i];
+
+        if (op.status == AsyncStatusQueued && op.isSend) {
+            if (!setHexMode()) {
+                completeOperation(i, AsyncStatusFailed);
+                continue;
+            }
+
+            writeSocketSend(op.socketID, op.remoteHost, op.remotePort, op.buffer, op.size);
+
+            op.status = AsyncStatusActive;
+            _activeOperation = i;
+
+            return;
+        }
+    }
+}
+
+// Handles a response line of the command in progress. Returns true if it was one.
+bool Sodaq_N3X::handleOperationLine(const char* line)
+{
+    int retSocketID;
+    int sentLength;
+
+    if (_activeOperation < 0) {
+        if (!_draining) {
+            return false;
+        }
+
+        // The response of a command that timed out, its operation already completed.
+        switch (classifyLine(line)) {
+        case LineOK:
+        case LineError:
+            _draining = false;
+            return true;
+
+        case LineEcho:
+            return true;
+
+        default:
+            return STARTS_WITH(line, STR_RESPONSE_USOST);
+        }
+    }
+
+    SocketOperation& op = _operations[_activeOperation];
+
+    switch (classifyLine(line)) {
+    case LineOK:
+        commandDone();
+        _failedCommands = 0;
+        completeOperation(_activeOperation, (op.length > 0) ? AsyncStatusDone : AsyncStatusFailed);
+        return true;
+
+    case LineError:
+        commandError(line);
+
+        if (STARTS_WITH(line, STR_RESPONSE_CME_ERROR)) {
+            op.error = _lastCMEError;
+        }
+
+        completeOperation(_activeOperation, AsyncStatusFailed);
+        return true;
+
+    case LineEcho:
+        return true;
+
+    default:
+        if (STARTS_WITH(line, STR_RESPONSE_USOST) &&
+                sscanf(line + STRLEN(STR_RESPONSE_USOST), "%d,%d", &retSocketID, &sentLength) == 2) {
+            op.length = (sentLength > 0) ? sentLength : 0;
+            return true;
+        }
+
+        return false;
+    }
+}
+
+// Sets the final status of an operation and updates the statistics.
+void Sodaq_N3X::completeOperation(int8_t handle, AsyncStatuses status)
+{
+    SocketOperation& op = _operations[handle];
+
+    if (handle == _activeOperation) {
+        _activeOperation = -1;
+
+        if (status == AsyncStatusTimedOut) {
+            commandDone();
+            _timeoutCount++;
+            _failedCommands++;
+
+            // The modem still owes the final result code, which must not be taken for
+            // that of the next command.
+            _draining = true;
+        }
+    }
+
+    op.status = status;
+
+    if (!op.isSend) {
+        return;
+    }
+
+    if (status == AsyncStatusDone) {
+        _socketStatistics[op.socketID].datagramsSent++;
+        _socketStatistics[op.socketID].bytesSent += op.length;
+        _messagesSent++;
+    }
+    else {
+        _socketStatistics[op.socketID].sendErrors++;
+    }
+}
+
+// Waits for the result of the command in progress, before another command is sent.
+void Sodaq_N3X::finishActiveOperation()
+{
+    if (!isCommandInProgress()) {
+        return;
+    }
+
+    uint32_t from = beginWait();
+
+    while (true) {
+        uint32_t start   = _draining ? _commandStart : _operations[_activeOperation].start;
+        uint32_t timeout = _draining ? _socketWriteTimeout : _operations[_activeOperation].timeout;
+
+        if (!_draining && is_timedout(start, timeout)) {
+            // Keeps waiting for its final result code.
+            completeOperation(_activeOperation, AsyncStatusTimedOut);
+            continue;
+        }
+
+        processURCs();
+        sodaq_wdt_reset();
+
+        if (!isCommandInProgress()) {
+            break;
+        }
+
+        idle(timeout - min(NOW - start, timeout));
+    }
+
+    endWait(from);
+}
+
+// Makes the modem send and receive the socket data hex encoded, if that was not done
+// since it (re)started. Returns true if successful.
+bool Sodaq_N3X::setHexMode()
+{
+    if (!_hexModeSet) {
+        _hexModeSet = execCommand("AT+UDCONF=1,1");
+    }
+
+    return _hexModeSet;
+}
+
+// Returns true while the command of an asynchronous operation is in progress, or while
+// the result of one that timed out is still to come (up to the socket write timeout).
+bool Sodaq_N3X::isCommandInProgress()
+{
+    if (_draining && is_timedout(_commandStart, _socketWriteTimeout)) {
+        // The modem did not reply at all, stop waiting for it.
+        _draining = false;
+    }
+
+    return _activeOperation >= 0 || _draining;
+}
+
+
+/******************************************************************************
+* Private
+*****************************************************************************/
+
+int8_t Sodaq_N3X::checkApn(const char* requiredAPN)
+{
+    char buffer[256];
+
+    println("AT+CGDCONT?");
+
+    if (readResponse(buffer, sizeof(buffer), "+CGDCONT: ") != GSMResponseOK) {
+        return -1;
+    }
+
+    return parseApn(buffer, requiredAPN, NULL);
+}
+
+bool Sodaq_N3X::checkCFUN()
+{
+    char buffer[64];
+
+    println("AT+CFUN?");
+
+    if (readResponse(buffer, sizeof(buffer), "+CFUN: ") != GSMResponseOK) {
+        return false;
+    }
+
+    return (buffer[0] == '1') || setRadioActive(true);
+}
+
+bool Sodaq_N3X::checkURC(char* buffer)
+{
+    profileScope(ProfileURC);
+
+    if (!parseURC(buffer)) {
+        return false;
+    }
+
+    if (_urcHandler) {
+        _urcHandler(buffer, _urcHandlerContext);
+    }
+
+    return true;
+}
+
+bool Sodaq_N3X::parseURC(char* buffer)
+{
+    int param1, param2;
+
+    if (buffer[0] != '+') {
+        return false;
+    }
+
+    // Dispatch on the first letter, then only the matching URC is parsed.
+    switch (buffer[1]) {
+    case 'U':
+        // +UFOTAS: <blk_rm>,<transfer_status>
+        if (STARTS_WITH(buffer, STR_URC_UFOTAS) &&
+                sscanf(buffer + STRLEN(STR_URC_UFOTAS), "%d,%d", &param1, &param2) == 2) {
+            #ifdef DEBUG
+            debugPrint("Unsolicited: FOTA: ");
+            debugPrint(param1);
+            debugPrint(", ");
+            debugPrintln(param2);
+            #endif
+
+            setFOTAStatus((FOTAStatuses)param2, param1);
+
+            return true;
+        }
+
+        if (STARTS_WITH(buffer, STR_URC_UUSORF) &&
+                sscanf(buffer + STRLEN(STR_URC_UUSORF), "%d,%d", &param1, &param2) == 2) {
+            debugPrint("Unsolicited: Socket ");
+            debugPrint(param1);
+            debugPrint(": ");
+            debugPrintln(param2);
+
+            if (param1 >= 0 && param1 < SOCKET_COUNT) {
+                _socketPendingBytes[param1] += param2;
+            }
+
+            return true;
+        }
+
+        // +UUPING: <retry_num>,<p_size>,"<remote_hostname>","<remote_ip>",<ttl>,<rtt>
+        if (STARTS_WITH(buffer, STR_URC_UUPING) &&
+                sscanf(buffer + STRLEN(STR_URC_UUPING), "%*d,%*d,\"%*[^\"]\",\"%*[^\"]\",%d,%d", &param1, &param2) == 2) {
+            debugPrint("Unsolicited: Ping ");
+            debugPrintln(param2);
+
+            if (_pingActive && param2 >= 0) {
+                uint32_t rtt = param2;
 
-    while (!socketHasPendingBytes(socketID) && (millis() - startTime) < timeout) {
-        isAlive();
-        sodaq_wdt_safe_delay(10);
-    }
+                if (_pingStatistics.received == 0 || rtt < _pingStatistics.minRtt) {
+                    _pingStatistics.minRtt = rtt;
+                }
 
-    return socketHasPendingBytes(socketID);
-}
+                if (rtt > _pingStatistics.maxRtt) {
+                    _pingStatistics.maxRtt = rtt;
+                }
 
+                if (_pingStatistics.received > 0) {
+                    _pingJitterSum += (rtt > _pingLastRtt) ? rtt - _pingLastRtt : _pingLastRtt - rtt;
+                }
 
-/******************************************************************************
-* Private
-*****************************************************************************/
+                _pingRttSum  += rtt;
+                _pingLastRtt  = rtt;
+                _pingStatistics.ttl = param1;
+                _pingStatistics.received++;
+            }
 
-int8_t Sodaq_N3X::checkApn(const char* requiredAPN)
-{
-    char buffer[256];
+            return true;
+        }
 
-    println("AT+CGDCONT?");
+        if (STARTS_WITH(buffer, STR_URC_UUPINGER) &&
+                sscanf(buffer + STRLEN(STR_URC_UUPINGER), "%d", &param1) == 1) {
+            debugPrint("Unsolicited: Ping error ");
+            debugPrintln(param1);
 
-    if (readResponse(buffer, sizeof(buffer), "+CGDCONT: ") != GSMResponseOK) {
-        return -1;
-    }
+            if (_pingActive) {
+                _pingStatistics.lastError = param1;
+                _pingStatistics.lost++;
+            }
 
-    if (strncmp(buffer, "1,\"IP\"", 6) == 0 && strncmp(buffer + 6, ",\"\"", 3) != 0) {
-        char apn[64];
-        char ip[32];
+            return true;
+        }
 
-        if (sscanf(buffer + 6, ",\"%[^\"]\",\"%[^\"]\",0,0,0,0", apn, ip) != 2) { return -1; }
+        if (STARTS_WITH(buffer, STR_URC_UUPSMR) &&
+                sscanf(buffer + STRLEN(STR_URC_UUPSMR), "%d", &param1) == 1) {
+            debugPrint("Unsolicited: PSM ");
+            debugPrintln(param1);
 
-        if (strcmp(apn, requiredAPN) == 0) {
-            if (strlen(ip) >= 7 && strcmp(ip, "0.0.0.0") != 0) {
-                return 1;
+            if (param1 == 1) {
+                setPowerState(PowerStatePSM);
             }
-            else {
-                return 0;
+            else if (_powerState == PowerStatePSM) {
+                setPowerState(PowerStateIdle);
             }
-        }
-    }
 
-    return -1;
-}
+            return true;
+        }
 
-bool Sodaq_N3X::checkCFUN()
-{
-    char buffer[64];
+        if (STARTS_WITH(buffer, STR_URC_UUSOCL) &&
+                sscanf(buffer + STRLEN(STR_URC_UUSOCL), "%d", &param1) == 1) {
+            debugPrint("Unsolicited: Socket ");
+            debugPrintln(param1);
 
-    println("AT+CFUN?");
+            if (param1 >= 0 && param1 < SOCKET_COUNT) {
+                _socketClosedBit[param1] = true;
+            }
 
-    if (readResponse(buffer, sizeof(buffer), "+CFUN: ") != GSMResponseOK) {
-        return false;
-    }
+            return true;
+        }
 
-    return (buffer[0] == '1') || setRadioActive(true);
-}
+        break;
 
-bool Sodaq_N3X::checkURC(char* buffer)
-{
-    int param1, param2;
+    case 'C':
+        // The URC is <stat>[,"<tac>",...], unlike the response to AT+CEREG? (<n>,<stat>[,...])
+        if (STARTS_WITH(buffer, STR_URC_CEREG) &&
+                sscanf(buffer + STRLEN(STR_URC_CEREG), "%d%n", &param1, &param2) == 1 &&
+                (buffer[STRLEN(STR_URC_CEREG) + param2] == 0 || buffer[STRLEN(STR_URC_CEREG) + param2 + 1] == '"')) {
+            debugPrint("Unsolicited: Registration ");
+            debugPrintln(param1);
 
-    if (buffer[0] != '+') {
-        return false;
-    }
+            setRegistrationStatus(param1);
 
-    if (sscanf(buffer, "+UFOTAS: %d,%d", &param1, &param2) == 2) {
-        #ifdef DEBUG
-        debugPrint("Unsolicited: FOTA: ");
-        debugPrint(param1);
-        debugPrint(", ");
-        debugPrintln(param2);
-        #endif
+            return true;
+        }
 
-        return true;
-    }
+        if (STARTS_WITH(buffer, STR_URC_CSCON) &&
+                sscanf(buffer + STRLEN(STR_URC_CSCON), "%d", &param1) == 1) {
+            debugPrint("Unsolicited: Connected ");
+            debugPrintln(param1);
 
-    if (sscanf(buffer, "+UUSORF: %d,%d", &param1, &param2) == 2) {
-        debugPrint("Unsolicited: Socket ");
-        debugPrint(param1);
-        debugPrint(": ");
-        debugPrintln(param2);
+            setPowerState(param1 == 1 ? PowerStateConnected : PowerStateIdle);
 
-        if (param1 >= 0 && param1 < SOCKET_COUNT) {
-            _socketPendingBytes[param1] += param2;
+            return true;
         }
 
-        return true;
+        break;
     }
 
-    if (sscanf(buffer, "+UUSOCL: %d", &param1) == 1) {
-        debugPrint("Unsolicited: Socket ");
-        debugPrintln(param1);
+    return false;
+}
 
-        if (param1 >= 0 && param1 < SOCKET_COUNT) {
-            _socketClosedBit[param1] = true;
-        }
+// Gets the operator and cell the modem is registered with.
+// Returns true if successful.
+bool Sodaq_N3X::getNetworkInfo(NetworkInfo* info)
+{
+    char buffer[64];
 
-        return true;
+    memset(info, 0, sizeof(*info));
+
+    // Make sure the operator is reported in numeric format.
+    if (!execCommand("AT+COPS=3,2")) {
+        return false;
     }
 
-    if (sscanf(buffer, "+CSCON: %d", &param1) == 1) {
-        debugPrint("Unsolicited: Connected ");
-        debugPrintln(param1);
-        return true;
+    println("AT+COPS?");
+
+    if (readResponse(buffer, sizeof(buffer), "+COPS: ") != GSMResponseOK) {
+        return false;
     }
 
-    return false;
+    if (sscanf(buffer, "%*d,%*d,\"%6[0-9]\"", info->plmn) != 1) {
+        return false;
+    }
+
+    return getCellId(&info->tac, &info->cellId);
 }
 
 bool Sodaq_N3X::doSIMcheck()
 {
-    const uint8_t retry_count = 10;
-
-    for (uint8_t i = 0; i < retry_count; i++) {
-        if (i > 0) {
-            sodaq_wdt_safe_delay(250);
-        }
+    uint32_t delay = 0;
 
+    for (uint8_t attempts = 1; ; attempts++) {
         if (getSimStatus() == SimReady) {
             return true;
         }
-    }
 
-    return false;
+        if (!retryWait(RetryLoopSIM, attempts, &delay)) {
+            return false;
+        }
+    }
 }
 
 /**
@@ -990,11 +2888,16 @@ bool Sodaq_N3X::doSIMcheck()
  * 4. if response prefix is not empty, check response prefix, append if multiline
  * 5. check URC, if handled => continue
  * 6. if response prefis is empty, return the whole line return line buffer, append if multiline
+ *
+ * With "line", it returns at the first line with the prefix instead, and points "line" to the rest
+ * of it in the input buffer, or to NULL if the final result code came first.
 */
-GSMResponseTypes Sodaq_N3X::readResponse(char* outBuffer, size_t outMaxSize, const char* prefix, uint32_t timeout)
+GSMResponseTypes Sodaq_N3X::readResponse(char* outBuffer, size_t outMaxSize, const char* prefix, uint32_t timeout,
+                                         char** line)
 {
     bool usePrefix    = prefix != NULL && prefix[0] != 0;
     bool useOutBuffer = outBuffer != NULL && outMaxSize > 0;
+    size_t prefixLen  = usePrefix ? strlen(prefix) : 0;
 
     uint32_t from = NOW;
 
@@ -1004,6 +2907,16 @@ GSMResponseTypes Sodaq_N3X::readResponse(char* outBuffer, size_t outMaxSize, con
         outBuffer[0] = 0;
     }
 
+    if (line) {
+        *line = NULL;
+    }
+
+    // The deadline the idle callback gets, instead of that of each character.
+    if (_awaitingResponse) {
+        _responseFrom    = from;
+        _responseTimeout = timeout;
+    }
+
     while (!is_timedout(from, timeout)) {
         int count = readLn(_inputBuffer, _inputBufferSize, 250); // 250ms, how many bytes at which baudrate?
         sodaq_wdt_reset();
@@ -1012,29 +2925,39 @@ GSMResponseTypes Sodaq_N3X::readResponse(char* outBuffer, size_t outMaxSize, con
             continue;
         }
 
+        profileScope(ProfileResponseLine);
+
         debugPrint("<< ");
         debugPrintln(_inputBuffer);
 
-        if (startsWith(STR_AT, _inputBuffer)) {
+        LineTypes lineType = classifyLine(_inputBuffer);
+
+        if (lineType == LineEcho) {
             continue; // skip echoed back command
         }
 
-        if (startsWith(STR_RESPONSE_OK, _inputBuffer)) {
+        if (lineType == LineOK) {
+            commandDone();
+            _failedCommands = 0;
             return GSMResponseOK;
         }
 
-        if (startsWith(STR_RESPONSE_ERROR, _inputBuffer) ||
-                startsWith(STR_RESPONSE_CME_ERROR, _inputBuffer) ||
-                startsWith(STR_RESPONSE_CMS_ERROR, _inputBuffer)) {
+        if (lineType == LineError) {
+            commandError(_inputBuffer);
             return GSMResponseError;
         }
 
-        bool hasPrefix = usePrefix && useOutBuffer && startsWith(prefix, _inputBuffer);
+        bool hasPrefix = usePrefix && (useOutBuffer || line != NULL) && (strncmp(prefix, _inputBuffer, prefixLen) == 0);
 
         if (!hasPrefix && checkURC(_inputBuffer)) {
             continue;
         }
 
+        if (hasPrefix && line != NULL) {
+            *line = _inputBuffer + prefixLen;
+            return GSMResponseOK;
+        }
+
         if (hasPrefix || (!usePrefix && useOutBuffer)) {
             if (outSize > 0 && outSize < outMaxSize - 1) {
                 outBuffer[outSize++] = LF;
@@ -1043,9 +2966,8 @@ GSMResponseTypes Sodaq_N3X::readResponse(char* outBuffer, size_t outMaxSize, con
             if (outSize < outMaxSize - 1) {
                 char* inBuffer = _inputBuffer;
                 if (hasPrefix) {
-                    int i = strlen(prefix);
-                    count -= i;
-                    inBuffer += i;
+                    count -= prefixLen;
+                    inBuffer += prefixLen;
                 }
                 if (outSize + count > outMaxSize - 1) {
                     count = outMaxSize - 1 - outSize;
@@ -1059,20 +2981,154 @@ GSMResponseTypes Sodaq_N3X::readResponse(char* outBuffer, size_t outMaxSize, con
 
     debugPrintln("<< timed out");
 
+    // Only count the timeouts of commands, not those of reading the remaining responses.
+    if (_awaitingResponse) {
+        commandDone();
+        _timeoutCount++;
+        _failedCommands++;
+    }
+
     return GSMResponseTimeout;
 }
 
+// Aborts the command that readResponse() gave up on, and reads its final result code,
+// so it is not taken for the result of the next command.
+// Returns true if the final result code was read.
+bool Sodaq_N3X::abortCommand()
+{
+    uint32_t from = NOW;
+
+    // Any character aborts an abortable command.
+    writeByte(CR);
+
+    while (!is_timedout(from, ABORT_TIMEOUT)) {
+        if (readLn(_inputBuffer, _inputBufferSize, 250) <= 0) {
+            continue;
+        }
+
+        sodaq_wdt_reset();
+
+        debugPrint("<< ");
+        debugPrintln(_inputBuffer);
+
+        LineTypes lineType = classifyLine(_inputBuffer);
+
+        if (lineType == LineOK || lineType == LineError || STARTS_WITH(_inputBuffer, STR_RESPONSE_ABORTED)) {
+            return true;
+        }
+
+        checkURC(_inputBuffer);
+    }
+
+    debugPrintln("<< abort timed out");
+
+    return false;
+}
+
+// Marks the end of the current command that failed with the given error line.
+void Sodaq_N3X::commandError(const char* line)
+{
+    commandDone();
+    _errorCount++;
+
+    if (STARTS_WITH(line, STR_RESPONSE_CME_ERROR)) {
+        _lastCMEError = atoi(line + STRLEN(STR_RESPONSE_CME_ERROR));
+
+        // SIM errors are not solved by a reboot. The SIM may have been changed.
+        if (_lastCMEError < CME_ERROR_SIM_FIRST || _lastCMEError > CME_ERROR_SIM_LAST) {
+            _failedCommands++;
+        }
+        else {
+            _identityValid = false;
+        }
+    }
+}
+
+// Marks the end of the current command and adds its duration to the command time.
+void Sodaq_N3X::commandDone()
+{
+    if (!_awaitingResponse) {
+        return;
+    }
+
+    _awaitingResponse = false;
+    _responseTimeout  = 0;
+    _commandTime += millis() - _commandStart;
+}
+
+// Reads the registration status with AT+CEREG?.
+bool Sodaq_N3X::readRegistrationStatus()
+{
+    char buffer[64];
+    int n;
+    int status;
+
+    println("AT+CEREG?");
+
+    // +CEREG: <n>,<stat>[,...]
+    if (readResponse(buffer, sizeof(buffer), STR_URC_CEREG) != GSMResponseOK) {
+        return false;
+    }
+
+    if (sscanf(buffer, "%d,%d", &n, &status) != 2) {
+        return false;
+    }
+
+    setRegistrationStatus(status);
+
+    return true;
+}
+
+// Enables the unsolicited result codes the library tracks, after the modem (re)started.
+// Returns true if successful.
+bool Sodaq_N3X::enableURCs()
+{
+    // Report the RRC connection state, for the energy accounting.
+    if (!execCommand("AT+CSCON=1")) {
+        return false;
+    }
+
+    // Report the registration state, for the reboot policy.
+    if (!execCommand("AT+CEREG=2")) {
+        return false;
+    }
+
+    // The URC only reports changes, start from the current state.
+    return readRegistrationStatus();
+}
+
+// Forgets the evidence for the reboot policy, when the modem (re)starts.
+void Sodaq_N3X::resetRebootEvidence()
+{
+    setRegistrationStatus(-1);
+    _failedCommands = 0;
+}
+
+// Keeps track of the registration status and since when the modem is in that status.
+void Sodaq_N3X::setRegistrationStatus(int8_t status)
+{
+    if (status != _regStatus) {
+        _regStatus      = status;
+        _regStatusSince = millis();
+    }
+}
+
 void Sodaq_N3X::reboot()
 {
     println("AT+CFUN=16");
 
+    resetRebootEvidence();
+    resetFOTAStatus();
+    _signalSampleTime = 0;
+    _hexModeSet       = false;
+
     // wait up to 2000ms for the modem to come up
     uint32_t start = millis();
 
     while ((readResponse() != GSMResponseOK) && !is_timedout(start, 2000)) {}
 
     // wait for the reboot to start
-    sodaq_wdt_safe_delay(REBOOT_DELAY);
+    wait(REBOOT_DELAY);
 
     while (!is_timedout(start, REBOOT_TIMEOUT)) {
         if (getSimStatus() == SimReady) {
@@ -1083,10 +3139,117 @@ void Sodaq_N3X::reboot()
     // echo off again after reboot
     execCommand("ATE0");
 
+    // The restart disabled the unsolicited result codes.
+    enableURCs();
+
     // extra read just to clear the input stream
     readResponse(NULL, 0, NULL, 250);
 }
 
+// Waits before the next attempt of a retry loop, following the policy of that loop.
+// "attempts" is the number of attempts done so far, "delay" holds the previous delay.
+// The wait is cut short at the deadline ("timeout" ms after "start"), if there is one.
+// Returns false, without waiting, if the loop has to give up.
+bool Sodaq_N3X::retryWait(RetryLoops loop, uint8_t attempts, uint32_t* delay, uint32_t start, uint32_t timeout)
+{
+    const RetryPolicy& policy = _retryPolicy[loop];
+
+    if (policy.maxAttempts > 0 && attempts >= policy.maxAttempts) {
+        return false;
+    }
+
+    if (timeout > 0 && is_timedout(start, timeout)) {
+        return false;
+    }
+
+    switch (policy.schedule) {
+    case RetryFixed:
+        *delay = policy.initialDelay;
+        break;
+    case RetryLinear:
+        *delay = (attempts == 1) ? policy.initialDelay : *delay + policy.increment;
+        break;
+    case RetryExponential:
+        *delay = (attempts == 1) ? policy.initialDelay : *delay * 2;
+        break;
+    case RetryDecorrelatedJitter: {
+        // Random between the initial delay and three times the previous one.
+        // At least 1 ms, a delay of 0 would never grow.
+        uint32_t minDelay = max(policy.initialDelay, (uint32_t)1);
+
+        *delay = (attempts == 1) ? policy.initialDelay : random(minDelay, max(*delay, minDelay) * 3 + 1);
+        break;
+    }
+    }
+
+    if (policy.maxDelay > 0 && *delay > policy.maxDelay) {
+        *delay = policy.maxDelay;
+    }
+
+    uint32_t wait_ms = *delay;
+
+    if (timeout > 0 && wait_ms > timeout - (millis() - start)) {
+        wait_ms = timeout - (millis() - start);
+    }
+
+    _retryStatistics[loop].retries++;
+    _retryStatistics[loop].waitTime += wait_ms;
+
+    wait(wait_ms);
+
+    return true;
+}
+
+// Waits for "ms" milliseconds. All waits of the library go through here.
+// The unsolicited result codes received in the meantime are handled right away,
+// instead of piling up in the stream buffer.
+void Sodaq_N3X::wait(uint32_t ms)
+{
+    uint32_t from = beginWait();
+
+    while (!is_timedout(from, ms)) {
+        processURCs();
+        sodaq_wdt_reset();
+        idle(ms - min(NOW - from, ms));
+    }
+
+    endWait(from);
+}
+
+// Starts a wait for the modem, and returns the time it started.
+uint32_t Sodaq_N3X::beginWait()
+{
+    _waitDepth++;
+
+    return NOW;
+}
+
+// Ends a wait for the modem. Only the outermost of nested waits is added to the wait time,
+// e.g. not the reads while wait() handles unsolicited result codes.
+void Sodaq_N3X::endWait(uint32_t from)
+{
+    if (--_waitDepth == 0) {
+        _waitTime += NOW - from;
+    }
+}
+
+// Hands the CPU to the idle callback, if any, while waiting for the modem.
+void Sodaq_N3X::idle(uint32_t timeLeft)
+{
+    if (!_idleCallback || timeLeft == 0) {
+        return;
+    }
+
+    // Also when waiting outside a command, so the callback is always called the same way.
+    Lock lock(this);
+
+    uint32_t from = NOW;
+
+    _idleCallback(timeLeft, _idleCallbackContext);
+
+    _idleTime += NOW - from;
+}
+
 bool Sodaq_N3X::waitForSignalQuality(uint32_t timeout)
 {
     uint32_t start = millis();
@@ -1094,9 +3257,16 @@ bool Sodaq_N3X::waitForSignalQuality(uint32_t timeout)
     int8_t rssi;
     uint8_t ber;
 
-    uint32_t delay_count = 500;
+    uint32_t delay = 0;
+
+    // A recent sample that is good enough saves sending AT+CSQ.
+    if (isSignalSampleFresh() && _signalQuality.rssi != 0 && _signalQuality.rssi >= minRSSI) {
+        _lastRSSI = _signalQuality.rssi;
+        _CSQtime  = 0;
+        return true;
+    }
 
-    while (!is_timedout(start, timeout)) {
+    for (uint8_t attempts = 1; ; attempts++) {
         if (getRSSIAndBER(&rssi, &ber)) {
             if (rssi != 0 && rssi >= minRSSI) {
                 _lastRSSI = rssi;
@@ -1105,15 +3275,10 @@ bool Sodaq_N3X::waitForSignalQuality(uint32_t timeout)
             }
         }
 
-        sodaq_wdt_safe_delay(delay_count);
-
-        // Next time wait a little longer, but not longer than 5 seconds
-        if (delay_count < 5000) {
-            delay_count += 1000;
+        if (!retryWait(RetryLoopSignal, attempts, &delay, start, timeout)) {
+            return false;
         }
     }
-
-    return false;
 }
 
 
@@ -1162,6 +3327,9 @@ bool Sodaq_N3X::isOn() const
 void Sodaq_N3X::writeProlog()
 {
     if (!_appendCommand) {
+        // Don't mix a new command with the response of an asynchronous one.
+        finishActiveOperation();
+
         debugPrint(">> ");
         _appendCommand = true;
     }
@@ -1300,6 +3468,9 @@ size_t Sodaq_N3X::println()
     debugPrintln();
     size_t i = print(CR);
     _appendCommand = false;
+    _awaitingResponse = true;
+    _commandStart = millis();
+    _commandCount++;
     return i;
 }
 
@@ -1323,19 +3494,36 @@ void Sodaq_N3X::setModemStream(Stream& stream)
 }
 
 // Returns a character from the modem stream if read within _timeout ms or -1 otherwise.
-int Sodaq_N3X::timedRead(uint32_t timeout) const
+int Sodaq_N3X::timedRead(uint32_t timeout)
 {
-    uint32_t _startMillis = millis();
+    int c = _modemStream->read();
+
+    if (c >= 0) {
+        return c;
+    }
+
+    uint32_t _startMillis = beginWait();
 
     do {
-        int c = _modemStream->read();
+        uint32_t timeLeft = timeout - min(millis() - _startMillis, timeout);
+
+        // Within a response, until the deadline of the command.
+        if (_awaitingResponse && _responseTimeout > 0) {
+            timeLeft = max(timeLeft, _responseTimeout - min(NOW - _responseFrom, _responseTimeout));
+        }
+
+        idle(timeLeft);
+
+        c = _modemStream->read();
 
         if (c >= 0) {
-            return c;
+            break;
         }
     } while (millis() - _startMillis < timeout);
 
-    return -1; // -1 indicates timeout
+    endWait(_startMillis);
+
+    return c; // -1 indicates timeout
 }
 
 // Fills the given "buffer" with characters read from the modem stream up to "length"
@@ -1394,6 +3582,8 @@ size_t Sodaq_N3X::readBytes(uint8_t* buffer, size_t length, uint32_t timeout)
 // Returns the number of bytes read, not including the null terminator.
 size_t Sodaq_N3X::readLn(char* buffer, size_t size, uint32_t timeout)
 {
+    profileScope(ProfileReadLn);
+
     // Use size-1 to leave room for a string terminator
     size_t len = readBytesUntil(SODAQ_GSM_TERMINATOR[SODAQ_GSM_TERMINATOR_LEN - 1], buffer, size - 1, timeout);
 
@@ -1410,6 +3600,52 @@ size_t Sodaq_N3X::readLn(char* buffer, size_t size, uint32_t timeout)
 }
 
 
+/******************************************************************************
+* Payload
+*****************************************************************************/
+
+// Writes a byte of the payload. Returns 0 if the payload is already complete or ended.
+size_t Sodaq_N3X_Payload::write(uint8_t value)
+{
+    if (_ended) {
+        return 0;
+    }
+
+    if (_modem == NULL) {
+        _length++;
+        return 1;
+    }
+
+    if (_length >= _size) {
+        return 0;
+    }
+
+    _modem->writeHexByte(value);
+    _length++;
+
+    return 1;
+}
+
+// Sends the payload, if all of its bytes were written.
+size_t Sodaq_N3X_Payload::end()
+{
+    Sodaq_N3X* modem = _modem;
+
+    if (_ended) {
+        return 0;
+    }
+
+    if (modem == NULL) {
+        return _length;
+    }
+
+    _modem = NULL;
+    _ended = true;
+
+    return modem->endPayload(*this);
+}
+
+
 /******************************************************************************
  * OnOff
  *****************************************************************************/
@@ -1426,6 +3662,7 @@ Sodaq_SARA_N310_OnOff::Sodaq_SARA_N310_OnOff()
     #endif
 
     _onoff_status = false;
+    _togglePulse  = 1000;
 }
 
 void Sodaq_SARA_N310_OnOff::on()
@@ -1436,8 +3673,7 @@ void Sodaq_SARA_N310_OnOff::on()
 
     pinMode(SARA_R4XX_TOGGLE, OUTPUT);
     digitalWrite(SARA_R4XX_TOGGLE, LOW);
-    // We should be able to reduce this to 50ms or something
-    sodaq_wdt_safe_delay(1000);
+    sodaq_wdt_safe_delay(_togglePulse);
     pinMode(SARA_R4XX_TOGGLE, INPUT);
 
     _onoff_status = true;
@@ -1461,3 +3697,4 @@ bool Sodaq_SARA_N310_OnOff::isOn()
 {
     return _onoff_status;
 }
+
@@ -34,12 +34,14 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "Arduino.h"
 
+// Uncomment to measure the time spent in the parsing hot spots, see getProfileCounter().
+//#define SODAQ_N3X_PROFILE
 
 #define DEFAULT_READ_MS                 5000
 #define SODAQ_MAX_SEND_MESSAGE_SIZE     512
 #define SODAQ_N3X_DEFAULT_CID           1
 #define SODAQ_N3X_DEFAULT_UDP_TIMOUT_MS 15000
-#define SODAQ_N3X_MAX_UDP_BUFFER        256
+#define SODAQ_N3X_MAX_UDP_BUFFER        512   // the most bytes read with one AT+USORF
 
 enum GSMResponseTypes {
     GSMResponseNotFound = 0,
@@ -73,12 +75,258 @@ struct ReceivedMessageStatus {
     uint16_t droppedSinceBoot;
 };
 
+#ifdef SODAQ_N3X_PROFILE
+enum ProfilePoints {
+    ProfileReadLn = 0,        // reading a line, including waiting for its characters
+    ProfileResponseLine,      // matching a line in readResponse(), including checkURC()
+    ProfileURC,               // checkURC()
+    ProfileHexEncode,         // encoding the payload in socketSend()
+    ProfileHexDecode,         // decoding the payload in socketReceive()
+    ProfilePointCount
+};
+
+struct ProfileCounter {
+    uint32_t calls;
+    uint32_t micros;
+};
+#endif
+
+enum PowerStates {
+    PowerStateOff = 0,
+    PowerStateBooting,
+    PowerStateIdle,
+    PowerStateConnected,      // RRC connected, see +CSCON
+    PowerStatePSM,            // in power saving mode, see +UUPSMR
+    PowerStateCount
+};
+
+struct EnergyStatistics {
+    uint32_t stateTime[PowerStateCount];  // ms spent in each of the power states
+    uint32_t commandTime;                 // ms spent waiting for command responses
+    uint32_t messagesSent;
+    float    charge;                      // estimated charge used in mAh
+    float    chargePerMessage;            // estimated charge used per sent message in mAh
+};
+
+// The CIoT EPS optimisations of AT+CCIOTOPT.
+enum CIoTOptimisations {
+    CIoTOptimisationNone         = 0,
+    CIoTOptimisationControlPlane = 1,   // data over the control plane (NAS)
+    CIoTOptimisationUserPlane    = 2,   // suspend/resume of the RRC connection
+    CIoTOptimisationBoth         = 3    // only as supported optimisation
+};
+
+// The PDP header compressions (h_comp) of AT+CGDCONT.
+enum HeaderCompressions {
+    HeaderCompressionOff     = 0,
+    HeaderCompressionDefault = 1,   // the manufacturer's preference
+    HeaderCompressionRFC1144 = 2,
+    HeaderCompressionRFC2507 = 3,
+    HeaderCompressionROHC    = 4    // RFC 3095
+};
+
+// The +CEREG registration statuses.
+enum RegistrationStatuses {
+    RegStatusNotSearching = 0,
+    RegStatusHome         = 1,
+    RegStatusSearching    = 2,
+    RegStatusDenied       = 3,
+    RegStatusUnknown      = 4,
+    RegStatusRoaming      = 5
+};
+
+enum RebootReasons {
+    RebootReasonNone = 0,
+    RebootReasonFailedCommands,   // consecutive command timeouts or (non SIM) +CME errors
+    RebootReasonDenied,           // registration denied for too long
+    RebootReasonNotSearching,     // not registered and not searching for too long
+    RebootReasonAttachTime        // attaching took too long
+};
+
+// When connect() reboots the modem to recover. A value of 0 disables that rule.
+struct RebootPolicy {
+    uint32_t deniedTime;          // ms the registration was denied
+    uint32_t searchTime;          // ms the modem was not registered and not searching
+    uint8_t  failedCommands;      // consecutive failed commands
+    uint32_t attachTime;          // ms waiting for signal and attach took (disabled by default)
+};
+
+// The loops that retry until the modem is ready.
+enum RetryLoops {
+    RetryLoopOn = 0,          // on(): waiting for the modem to reply
+    RetryLoopSIM,             // waiting for the SIM to be ready
+    RetryLoopApn,             // connect(): waiting for the APN and IP address
+    RetryLoopSignal,          // waiting for the signal quality
+    RetryLoopAttach,          // attachGprs()
+    RetryLoopCount
+};
+
+enum RetrySchedules {
+    RetryFixed = 0,           // always the initial delay
+    RetryLinear,              // the initial delay, increased by "increment" every attempt
+    RetryExponential,         // the initial delay, doubled every attempt
+    RetryDecorrelatedJitter   // random between the initial delay and three times the previous delay
+};
+
+struct RetryPolicy {
+    RetrySchedules schedule;
+    uint32_t initialDelay;    // ms
+    uint32_t increment;       // ms, RetryLinear only
+    uint32_t maxDelay;        // ms, 0 for no maximum
+    uint8_t  maxAttempts;     // 0 to keep trying until the timeout of the loop
+};
+
+struct RetryStatistics {
+    uint32_t retries;
+    uint32_t waitTime;        // ms
+};
+
+enum ConnectPhases {
+    ConnectPhaseOn = 0,       // on()
+    ConnectPhaseInit,         // ATE0, AT+CMEE, AT+CIPCA, AT+UDCONF, AT+CCIOTOPT, AT+CSCON, AT+CEREG
+    ConnectPhaseCFUN,         // checkCFUN()
+    ConnectPhaseBandSel,      // setBandSel()
+    ConnectPhaseDefaultApn,   // setDefaultApn()
+    ConnectPhaseOperator,     // setOperator()
+    ConnectPhaseApn,          // setApn() and AT+CGACT
+    ConnectPhaseApnCheck,     // checkApn() polling
+    ConnectPhaseSignal,       // waitForSignalQuality()
+    ConnectPhaseAttach,       // attachGprs()
+    ConnectPhaseReboot,       // reboot() and attaching again, only when needed
+    ConnectPhaseSIM,          // doSIMcheck()
+    ConnectPhaseCount
+};
+
+struct ConnectTimeline {
+    uint32_t start;                         // millis() when connect() started
+    uint32_t phaseEnd[ConnectPhaseCount];   // ms after start each phase ended, 0 if not reached
+    uint32_t duration;                      // ms connect() took
+    uint8_t  apnChecks;                     // number of checkApn() calls
+    bool     warm;                          // the modem was still connected, nothing had to be done
+    bool     fastAttach;                    // attached to the stored network directly
+    RebootReasons rebootReason;             // why the modem was rebooted, if it was
+    bool     rebooted;
+    bool     success;
+};
+
+// The signal quality model, fed by every AT+CSQ.
+// The averages are exponential moving averages; a high RSSI variance indicates a flapping link.
+struct SignalQuality {
+    int8_t   rssi;           // the last sample in dBm, 0 if not known or not detectable
+    uint8_t  ber;            // the last sample
+    float    averageRSSI;
+    float    varianceRSSI;
+    float    averageBER;
+    uint32_t age;            // ms since the last sample
+    uint32_t samples;        // the number of samples with a known RSSI
+};
+
+// The identity of the modem and its SIM, as read by readIdentity().
+struct ModemIdentity {
+    char imei[15 + 1];
+    char ccid[20 + 1];
+    char imsi[15 + 1];
+    char firmwareVersion[30 + 1];
+    char firmwareRevision[30 + 1];
+};
+
+struct SocketStatistics {
+    uint32_t datagramsSent;
+    uint32_t bytesSent;
+    uint32_t sendErrors;
+    uint32_t datagramsReceived;
+    uint32_t bytesReceived;
+};
+
+// The <transfer_status> of the +UFOTAS unsolicited result code.
+enum FOTAStatuses {
+    FOTAStatusIdle        = 0,
+    FOTAStatusDownloading = 1,
+    FOTAStatusDownloaded  = 2,   // the update is installed next, then the modem restarts
+    FOTAStatusFailed      = 3
+};
+
+// Called for every firmware update status change and download progress report.
+// FOTAStatusIdle after FOTAStatusDownloaded reports the update was installed.
+typedef void (*FOTAHandler)(FOTAStatuses status, uint16_t blocksRemaining, void* context);
+
+// The results of ping(), from the +UUPING and +UUPINGER unsolicited result codes.
+// The round trip times are in ms. The jitter is the mean difference between consecutive round trip times.
+struct PingStatistics {
+    uint8_t  sent;
+    uint8_t  received;
+    uint8_t  lost;
+    uint8_t  ttl;         // the TTL of the last reply
+    uint32_t minRtt;
+    uint32_t avgRtt;
+    uint32_t maxRtt;
+    uint32_t jitter;
+    int      lastError;   // the error code of the last +UUPINGER, or -1
+};
+
+// Called with each datagram received on a socket, see socketSetReceiveHandler().
+// The data is only valid during the call.
+typedef void (*ReceiveHandler)(uint8_t socketID, const uint8_t* data, size_t length,
+                               const char* remoteIP, uint16_t remotePort, void* context);
+
+// A datagram read by socketReceiveBatch(). The caller sets buffer and size.
+// The length is the number of bytes read, at most "size".
+struct ReceiveSlot {
+    uint8_t* buffer;
+    size_t   size;
+    size_t   length;
+    char     remoteIP[16];
+    uint16_t remotePort;
+};
+
 #define UNUSED(x) (void)(x)
 
+// Called with the line of every unsolicited result code that was handled.
+typedef void (*URCHandler)(const char* urc, void* context);
+
+// Lock functions used to serialize access to the modem from several threads.
+typedef void (*LockFunction)(void* context);
+
+// Called while the library waits for the modem, with the time left until its next deadline (in ms).
+typedef void (*IdleCallback)(uint32_t timeLeft, void* context);
+
 typedef uint32_t IP_t;
 
 #define SOCKET_COUNT 7
 
+// The number of asynchronous socket operations that can be queued at the same time.
+#define SOCKET_OPERATION_COUNT 4
+
+enum AsyncStatuses {
+    AsyncStatusFree = 0,      // no operation with this handle
+    AsyncStatusQueued,        // waiting for the modem
+    AsyncStatusActive,        // the command was sent, waiting for its result
+    AsyncStatusDone,
+    AsyncStatusFailed,        // the modem replied with an error
+    AsyncStatusTimedOut
+};
+
+// Called from process() when an asynchronous socket operation completed, with the number of bytes
+// sent or received, and the +CME ERROR code (or -1).
+typedef void (*AsyncCallback)(int8_t handle, AsyncStatuses status, size_t length, int error, void* context);
+
+// An asynchronous socket operation. The buffer is owned by the caller.
+struct SocketOperation {
+    bool           isSend;
+    AsyncStatuses  status;
+    uint8_t        socketID;
+    char           remoteHost[16];   // IPv4 address
+    uint16_t       remotePort;
+    uint8_t*       buffer;
+    size_t         size;
+    size_t         length;
+    int            error;
+    uint32_t       start;
+    uint32_t       timeout;
+    AsyncCallback  callback;
+    void*          context;
+};
+
 class Sodaq_OnOffBee
 {
 public:
@@ -88,6 +336,27 @@ public:
     virtual bool isOn() = 0;
 };
 
+// The network the modem last attached to successfully.
+struct NetworkInfo {
+    char     plmn[7];     // numeric operator code (MCC and MNC)
+    uint16_t tac;         // tracking area code
+    uint32_t cellId;
+};
+
+// Persistent storage of the last network the modem attached to.
+// Implement this for the storage of the board (e.g. flash or EEPROM).
+class Sodaq_N3X_NetworkStore
+{
+public:
+    virtual ~Sodaq_N3X_NetworkStore() {}
+
+    // Fills "info" and returns true if a network was stored.
+    virtual bool load(NetworkInfo* info) = 0;
+
+    // Stores the network. Only called when it differs from the loaded one.
+    virtual void save(const NetworkInfo& info) = 0;
+};
+
 class Sodaq_SARA_N310_OnOff : public Sodaq_OnOffBee
 {
 public:
@@ -95,10 +364,16 @@ public:
     void on();
     void off();
     bool isOn();
+
+    // Sets how long (in ms) the power toggle pin is pulled low to switch the modem on.
+    void setTogglePulse(uint32_t ms) { _togglePulse = ms; }
 private:
     bool _onoff_status;
+    uint32_t _togglePulse;
 };
 
+class Sodaq_N3X_Payload;
+
 class Sodaq_N3X
 {
 public:
@@ -115,12 +390,70 @@ public:
     bool on();
     bool off();
 
+    // Sets how long (in ms) on() waits for the reply to each "AT" probe.
+    // The number of probes and the delay between them is set with setRetryPolicy(RetryLoopOn, ...).
+    void setBootProbeTimeout(uint32_t timeout) { _bootProbeTimeout = timeout; }
+
+    // Returns the time (in ms) the last power up took, from the start of on() to the first "OK".
+    uint32_t getBootTime() const { return _bootTime; }
+
     // Turns on and initializes the modem, then connects to the network and activates the data connection.
+    // Returns right away if the modem was left on and is still connected with the given APN, operator
+    // and band selection, and the configured CIoT optimisations.
     bool connect(const char* apn, const char* forceOperator = 0, const char* bandSel = 0);
 
     // Disconnects the modem from the network.
     bool disconnect();
 
+    // Sets the store of the network the modem last attached to.
+    // With automatic operator selection, connect() first tries to register with that network
+    // for up to "timeout" ms, and only then falls back to the full automatic search.
+    // Note that a successful attempt leaves the modem in manual operator selection mode.
+    void setNetworkStore(Sodaq_N3X_NetworkStore* store, uint32_t timeout = 30000);
+
+    // Sets the CIoT optimisations the modem supports and prefers, and the header compression
+    // of the PDP context. connect() only changes the modem settings when they differ.
+    // By default the modem settings are left as they are.
+    void setCIoTOptimisation(CIoTOptimisations supported, CIoTOptimisations preferred,
+                             HeaderCompressions headerCompression = HeaderCompressionOff);
+
+    // Reads the CIoT optimisations the modem supports and prefers (AT+CCIOTOPT).
+    bool getCIoTOptimisation(CIoTOptimisations* supported, CIoTOptimisations* preferred);
+
+    // Sets when connect() reboots the modem to recover from a failing attach.
+    void setRebootPolicy(const RebootPolicy& policy) { _rebootPolicy = policy; }
+    const RebootPolicy& getRebootPolicy() const { return _rebootPolicy; }
+
+    // Returns the reason the modem should be rebooted to recover, or RebootReasonNone.
+    // "attachTime" is the time the last attempt to attach took, if any.
+    RebootReasons getRebootReason(uint32_t attachTime = 0) const;
+
+    // Returns the last registration status reported by the +CEREG URC (-1 if unknown, e.g. since
+    // the modem was switched on), and since when (millis()) the modem is in that status.
+    int8_t   getRegistrationStatus() const { return _regStatus; }
+    uint32_t getRegistrationStatusSince() const { return _regStatusSince; }
+
+    // Returns the code of the last +CME ERROR, or -1 if none.
+    int16_t  getLastCMEError() const { return _lastCMEError; }
+
+    // Sets the delays between the attempts of one of the retry loops.
+    void setRetryPolicy(RetryLoops loop, RetrySchedules schedule, uint32_t initialDelay, uint32_t increment = 0,
+                        uint32_t maxDelay = 0, uint8_t maxAttempts = 0);
+    void setRetryPolicy(RetryLoops loop, const RetryPolicy& policy) { _retryPolicy[loop] = policy; }
+    const RetryPolicy& getRetryPolicy(RetryLoops loop) const { return _retryPolicy[loop]; }
+
+    // Returns the number of retries of a loop and the time spent waiting between them.
+    const RetryStatistics& getRetryStatistics(RetryLoops loop) const { return _retryStatistics[loop]; }
+    void resetRetryStatistics() { memset(_retryStatistics, 0, sizeof(_retryStatistics)); }
+
+    // Returns the timeline of the last connect() attempt.
+    const ConnectTimeline& getConnectTimeline() const { return _connectTimeline; }
+
+    // Keeps the timeline of the last "size" connect() attempts in the given buffer.
+    // getConnectHistoryCount() returns the number of attempts recorded since.
+    void setConnectHistory(ConnectTimeline* buffer, uint8_t size);
+    uint32_t getConnectHistoryCount() const { return _connectHistoryCount; }
+
     // Returns the default baud rate of the modem.
     // To be used when initializing the modem stream for the first time.
     uint32_t getDefaultBaudrate() { return 57600; };
@@ -133,6 +466,29 @@ public:
     // Needs to be called before init().
     void setInputBufferSize(size_t value) { _inputBufferSize = value; };
 
+    // Sets the functions that lock and unlock the modem when it is shared between threads.
+    // The lock has to be recursive, as public methods call each other.
+    // Long waits (attachGprs(), socketWaitForReceive()) only hold the lock per command.
+    void setLock(LockFunction lock, LockFunction unlock, void* context = NULL);
+
+    // Sets the handler that is called for every unsolicited result code handled by the library.
+    // The handler is called from within the library (with the lock held) and must not
+    // call any of the modem methods.
+    void setURCHandler(URCHandler handler, void* context = NULL);
+
+    // Reads and handles the unsolicited result codes received from the modem, without
+    // sending any command. Keeps listening for "timeout" ms, and as long as data is available.
+    // Returns true if any unsolicited result code was handled.
+    // It may run in a thread of its own, it releases the lock between the lines it reads
+    // and between the calls of the idle callback.
+    bool processURCs(uint32_t timeout = 0);
+
+    // Sets the callback that is called repeatedly while the library waits for the modem,
+    // e.g. to go to standby until the next byte arrives, or to run other tasks.
+    // It should return well before "timeLeft" ms and must not call any of the modem methods.
+    // It is called with the modem lock held.
+    void setIdleCallback(IdleCallback callback, void* context = NULL);
+
 
     /******************************************************************************
     * Public
@@ -145,11 +501,19 @@ public:
     bool getFirmwareVersion(char* buffer, size_t size);
     bool getFirmwareRevision(char* buffer, size_t size);
     bool getIMEI(char* buffer, size_t size);
+    bool getIMSI(char* buffer, size_t size);
     bool getOperatorInfo(uint16_t* mcc, uint16_t* mnc);
     bool getOperatorInfoString(char* buffer, size_t size);
 
     SimStatuses getSimStatus();
 
+    // Reads the IMEI, CCID, IMSI and firmware version and revision, and keeps them for getIMEI(),
+    // getCCID(), getIMSI(), getFirmwareVersion() and getFirmwareRevision(), which call it when needed.
+    // Without a SIM the CCID and IMSI are left empty. They are read again after a SIM error,
+    // a firmware update, or when the modem is switched on with another SIM.
+    // Optionally copies them to "identity". Returns true if successful.
+    bool readIdentity(ModemIdentity* identity = NULL);
+
     bool execCommand(const char* command, uint32_t timeout = DEFAULT_READ_MS, char* buffer = NULL, size_t size = 0);
 
     // Returns true if the modem replies to "AT" commands without timing out.
@@ -162,6 +526,12 @@ public:
     bool isDefinedIP4();
 
     bool ping(const char* ip);
+
+    // Sends "count" echo requests of "size" bytes to the given host, and waits for the replies.
+    // Each request times out after "timeout" ms. Returns false if no reply was received.
+    bool ping(const char* host, uint8_t count, PingStatistics* stats, uint16_t size = 32,
+              uint32_t timeout = 5000, uint8_t ttl = 32);
+
     void purgeAllResponsesRead();
     bool setApn(const char* apn);
     bool setBandSel(const char* bandSel);
@@ -171,6 +541,56 @@ public:
     bool setVerboseErrors(bool on);
 
 
+    /******************************************************************************
+    * Statistics
+    *****************************************************************************/
+
+    // Returns the number of commands sent, and of those that failed with an error or timed out.
+    uint32_t getCommandCount() const { return _commandCount; }
+    uint32_t getErrorCount()   const { return _errorCount; }
+    uint32_t getTimeoutCount() const { return _timeoutCount; }
+
+    // Returns a score from 0 (unusable) to 100 (good), based on the last RSSI and
+    // the share of commands that failed or timed out.
+    // Useful to spread traffic over several modems.
+    uint8_t getHealthScore() const;
+
+    void resetCommandStatistics();
+
+    // Returns the time (in ms) spent waiting for the modem, the part of it handed to the
+    // idle callback, and the part the CPU was kept busy polling by the library.
+    uint32_t getWaitTime()     const { return _waitTime; }
+    uint32_t getIdleTime()     const { return _idleTime; }
+    uint32_t getBusyWaitTime() const { return _waitTime - _idleTime; }
+
+    void resetWaitStatistics();
+
+#ifdef SODAQ_N3X_PROFILE
+    // Returns the number of calls and the total time (in us) spent in a parsing hot spot.
+    // Multiply by F_CPU / 1000000 to get the number of cycles.
+    const ProfileCounter& getProfileCounter(ProfilePoints point) const { return _profile[point]; }
+    void resetProfileCounters() { memset(_profile, 0, sizeof(_profile)); }
+#endif
+
+
+    /******************************************************************************
+    * Energy
+    *****************************************************************************/
+
+    // Sets the current (in uA) the modem draws in the given power state.
+    // The defaults are rough values for the SARA N3X, calibrate them for the deployment.
+    void setStateCurrent(PowerStates state, uint32_t current) { _stateCurrent[state] = current; }
+
+    // Returns the power state, as far as the library knows it.
+    // The RRC connection state is only known after connect() enabled the +CSCON URC,
+    // and PSM is only reported once the application enabled the +UUPSMR URC (AT+UPSMR=1).
+    PowerStates getPowerState() const { return _powerState; }
+
+    // Gets the time spent in each power state, and the estimated charge used.
+    void getEnergyStatistics(EnergyStatistics* stats);
+    void resetEnergyStatistics();
+
+
     /******************************************************************************
     * RSSI and CSQ
     *****************************************************************************/
@@ -186,10 +606,39 @@ public:
     // Returns true if successful.
     bool    getRSSIAndBER(int8_t* rssi, uint8_t* ber);
 
+    // Gets the signal quality model. Only sends AT+CSQ when the last sample is older than the TTL.
+    // Returns true if successful.
+    bool    getSignalQuality(SignalQuality* quality);
+
+    // Sets how long (in ms) a signal quality sample is used by getSignalQuality(),
+    // waitForSignalQuality() and isConnected(), instead of sending AT+CSQ again. 0 disables it.
+    void    setSignalQualityTTL(uint32_t ttl) { _signalTTL = ttl; }
+
     void    setMinCSQ(int csq) { _minRSSI = convertCSQ2RSSI(csq); }
     void    setMinRSSI(int rssi) { _minRSSI = rssi; }
 
 
+    /******************************************************************************
+    * Firmware update
+    *****************************************************************************/
+
+    // Sets the handler that is called when the firmware update (FOTA) status changes.
+    // The handler is called from within the library and must not call any of the modem methods.
+    void setFOTAHandler(FOTAHandler handler, void* context = NULL);
+
+    // Returns the last firmware update status reported by the modem.
+    FOTAStatuses getFOTAStatus() const { return _fotaStatus; }
+
+    // Returns true while the modem downloads or installs a firmware update.
+    // A restart of the modem by the library (on(), reboot()) ends it.
+    bool isFOTAInProgress() const { return _fotaStatus == FOTAStatusDownloading || _fotaStatus == FOTAStatusDownloaded; }
+
+    // Sets how long (in ms) socketSend() waits for a firmware update in progress to finish.
+    // By default (0) it fails right away. After an update, socketSend() first runs connect()
+    // again with the last parameters; the sockets have to be created again.
+    void setFOTAWaitTimeout(uint32_t timeout) { _fotaWaitTimeout = timeout; }
+
+
     /******************************************************************************
     * Sockets
     *****************************************************************************/
@@ -198,8 +647,22 @@ public:
 
     size_t socketSend(uint8_t socketID, const char* remoteHost, const uint16_t remotePort, const uint8_t* buffer, size_t size);
     bool   socketWaitForReceive(uint8_t socketID, uint32_t timeout = SODAQ_N3X_DEFAULT_UDP_TIMOUT_MS);
+    // Reads at most "length" bytes of the next datagram, and returns the number of bytes read.
+    // The rest of a longer datagram stays pending, see socketHasPendingBytes().
     size_t socketReceive(uint8_t socketID, uint8_t* buffer, size_t length);
 
+    // Reads the pending datagrams of the socket into the slots, one AT+USORF after the other,
+    // then corrects the pending bytes with the number the modem reports.
+    // Each read is limited to the size of its slot, the rest of a longer datagram fills the next slot.
+    // Returns the number of slots filled.
+    size_t socketReceiveBatch(uint8_t socketID, ReceiveSlot* slots, size_t count);
+
+    // Sets the handler that is called with each datagram received on the socket, instead of
+    // polling socketHasPendingBytes() and calling socketReceive(). The datagrams are read after
+    // their +UUSORF, while the library waits or handles unsolicited result codes (processURCs(), process()).
+    // The handler gets the data decoded in place in the library's input buffer, without copying it.
+    void   socketSetReceiveHandler(uint8_t socketID, ReceiveHandler handler, void* context = NULL);
+
     bool   socketClose(uint8_t socketID, bool async = false);
     int    socketCloseAll();
     bool   socketIsClosed(uint8_t socketID);
@@ -208,24 +671,158 @@ public:
     size_t socketGetPendingBytes(uint8_t socketID);
     bool   socketHasPendingBytes(uint8_t socketID);
 
+    // Gets the traffic counters of the socket, since it was created.
+    // Returns true if successful.
+    bool   socketGetStatistics(uint8_t socketID, SocketStatistics* stats);
+    void   socketResetStatistics(uint8_t socketID);
+
+    // Sets how long socketSend() waits for the modem to accept a datagram.
+    void   setSocketWriteTimeout(uint32_t timeout) { _socketWriteTimeout = timeout; }
+
+    // Starts a datagram of "length" bytes that is written with the payload's print() methods,
+    // straight to the modem, and sent by payload.end(). The modem is locked until then,
+    // so no other modem methods may be called in between. Returns true if successful.
+    bool   beginPayload(Sodaq_N3X_Payload& payload, uint8_t socketID, const char* remoteHost,
+                        const uint16_t remotePort, size_t length);
+
+
+    /******************************************************************************
+    * Asynchronous sockets
+    *****************************************************************************/
+
+    // Queues a datagram to send, and returns the handle of the operation, or -1 if that failed.
+    // The buffer has to stay valid until the operation completed. The operation times out
+    // "timeout" ms after it was queued (by default the socket write timeout).
+    int8_t socketSendAsync(uint8_t socketID, const char* remoteHost, const uint16_t remotePort,
+                           const uint8_t* buffer, size_t size, uint32_t timeout = 0,
+                           AsyncCallback callback = NULL, void* context = NULL);
+
+    // Queues a read of the next datagram received on the socket, and returns the handle of
+    // the operation, or -1 if that failed. The buffer has to stay valid until the operation completed.
+    int8_t socketReceiveAsync(uint8_t socketID, uint8_t* buffer, size_t size,
+                              uint32_t timeout = SODAQ_N3X_DEFAULT_UDP_TIMOUT_MS,
+                              AsyncCallback callback = NULL, void* context = NULL);
+
+    // Returns the status of an operation without callback, with the number of bytes sent or
+    // received and the +CME ERROR code (or -1). Frees the handle once the operation completed.
+    AsyncStatuses socketAsyncStatus(int8_t handle, size_t* length = NULL, int* error = NULL);
+
+    // Drives the asynchronous socket operations and calls their callbacks. Call it from loop().
+    // Other modem methods first wait for the result of the command in progress, also of one
+    // that timed out (up to the socket write timeout after it was sent).
+    // The callbacks may call the modem methods, except process().
+    void   process();
+
 private:
     /******************************************************************************
     * Private
     *****************************************************************************/
 
+    // Holds the modem lock for the lifetime of the instance.
+    class Lock;
+
+    friend class Sodaq_N3X_Payload;
+
     uint8_t _cid;
+
+    // True once the socket data is hex encoded, since the modem (re)started.
+    bool    _hexModeSet;
+
     bool    _socketClosedBit[SOCKET_COUNT];
     size_t  _socketPendingBytes[SOCKET_COUNT];
+    SocketStatistics _socketStatistics[SOCKET_COUNT];
+
+    // The (optional) receive handlers of the sockets, and whether they are being called.
+    ReceiveHandler _receiveHandlers[SOCKET_COUNT];
+    void*          _receiveHandlerContexts[SOCKET_COUNT];
+    bool           _delivering;
+
+    // The identity read by readIdentity(), if valid.
+    ModemIdentity _identity;
+    bool          _identityValid;
+
+    // The firmware update status, its (optional) handler, and whether to connect again after it.
+    FOTAStatuses _fotaStatus;
+    FOTAHandler  _fotaHandler;
+    void*        _fotaHandlerContext;
+    uint32_t     _fotaWaitTimeout;
+    bool         _fotaReconnect;
+
+    // The parameters of the last connect(), to connect again after a firmware update.
+    char _connectApn[64];
+    char _connectOperator[8];
+    char _connectBandSel[32];
+
+    // The asynchronous socket operations, the one of which the command is in progress (or -1),
+    // and whether the result of a command that timed out is still to come.
+    SocketOperation _operations[SOCKET_OPERATION_COUNT];
+    int8_t          _activeOperation;
+    bool            _draining;
+
+    // The results of the running ping(), the sum of its round trip times and of their differences.
+    PingStatistics _pingStatistics;
+    bool           _pingActive;
+    uint32_t       _pingRttSum;
+    uint32_t       _pingJitterSum;
+    uint32_t       _pingLastRtt;
 
     int8_t checkApn(const char* requiredAPN);
     bool   checkCFUN();
     bool   checkURC(char* buffer);
+    bool   parseURC(char* buffer);
+    bool   doConnect(const char* apn, const char* forceOperator, const char* bandSel);
     bool   doSIMcheck();
+    bool   getNetworkInfo(NetworkInfo* info);
+    bool   isConnectedTo(const char* apn, const char* forceOperator, const char* bandSel);
+    bool   isOperatorSelected(const char* forceOperator);
+    bool   setOperator(const char* opr, uint32_t timeout);
+    void   markConnectPhase(ConnectPhases phase);
 
     GSMResponseTypes readResponse(char* outBuffer = NULL, size_t outMaxSize = 0, const char* prefix = NULL,
-                                  uint32_t timeout = DEFAULT_READ_MS);
+                                  uint32_t timeout = DEFAULT_READ_MS, char** line = NULL);
+    bool   abortCommand();
 
     void   reboot();
+    bool   retryWait(RetryLoops loop, uint8_t attempts, uint32_t* delay, uint32_t start = 0, uint32_t timeout = 0);
+    void   setPowerState(PowerStates state);
+    void   setRegistrationStatus(int8_t status);
+    bool   enableURCs();
+    bool   readRegistrationStatus();
+    void   resetRebootEvidence();
+    void   commandDone();
+    void   commandError(const char* line);
+    bool   applyCIoTOptimisation();
+    bool   checkFOTA();
+    int8_t queueOperation(uint8_t socketID, uint8_t* buffer, size_t size, uint32_t timeout,
+                          AsyncCallback callback, void* context);
+    void   startOperations();
+    bool   handleOperationLine(const char* line);
+    void   completeOperation(int8_t handle, AsyncStatuses status);
+    void   finishActiveOperation();
+    bool   isCommandInProgress();
+    bool   getIdentityValue(char* buffer, size_t size, const char* value);
+    void   checkIdentity();
+    bool   setHexMode();
+    int    socketReadDatagram(uint8_t socketID, uint8_t* buffer, size_t size, char* remoteIP, uint16_t* remotePort,
+                              bool deliver = false);
+    void   deliverReceived();
+    bool   socketReadPendingBytes(uint8_t socketID);
+    void   writeSocketSend(uint8_t socketID, const char* remoteHost, uint16_t remotePort,
+                           const uint8_t* buffer, size_t size);
+    void   writeSocketSendHeader(uint8_t socketID, const char* remoteHost, uint16_t remotePort, size_t size);
+    void   writeHexByte(uint8_t value);
+    size_t readSocketSendResponse(uint8_t socketID);
+    size_t endPayload(Sodaq_N3X_Payload& payload);
+    void   lock();
+    void   unlock();
+    void   addSignalSample(int8_t rssi, uint8_t ber);
+    bool   isSignalSampleFresh() const;
+    void   setFOTAStatus(FOTAStatuses status, uint16_t blocksRemaining);
+    void   resetFOTAStatus();
+    void   idle(uint32_t timeLeft);
+    uint32_t beginWait();
+    void   endWait(uint32_t from);
+    void   wait(uint32_t ms);
     bool   waitForSignalQuality(uint32_t timeout = 5L * 60L * 1000);
 
 
@@ -278,6 +875,11 @@ private:
     // This is the number of second it took when CSQ was record last
     uint8_t _CSQtime;
 
+    // The signal quality model, the time of its last sample (0 if none since power up) and its TTL.
+    SignalQuality _signalQuality;
+    uint32_t      _signalSampleTime;
+    uint32_t      _signalTTL;
+
     // This is the minimum required RSSI to continue making the connection
     // Use convertCSQ2RSSI if you have a CSQ value
     int _minRSSI;
@@ -285,6 +887,88 @@ private:
     // Keep track when connect started. Use this to record various status changes.
     uint32_t _startOn;
 
+    // The (optional) lock functions and their context.
+    LockFunction _lockFunction;
+    LockFunction _unlockFunction;
+    void*        _lockContext;
+
+    // The (optional) handler of unsolicited result codes and its context.
+    URCHandler _urcHandler;
+    void*      _urcHandlerContext;
+
+    // The CIoT optimisations and header compression set by connect(), if configured.
+    bool               _ciotConfigured;
+    CIoTOptimisations  _ciotSupported;
+    CIoTOptimisations  _ciotPreferred;
+    HeaderCompressions _headerCompression;
+
+    // The (optional) idle callback and its context.
+    IdleCallback _idleCallback;
+    void*        _idleCallbackContext;
+
+    // The time spent waiting for the modem, the part of it spent in the idle callback,
+    // and the number of nested waits in progress.
+    uint32_t _waitTime;
+    uint32_t _idleTime;
+    uint8_t  _waitDepth;
+
+    // The time socketSend() waits for the modem to accept a datagram.
+    uint32_t _socketWriteTimeout;
+
+    // True while a command was sent and its final result has not been read yet.
+    bool _awaitingResponse;
+
+    // When readResponse() started to wait for the result of that command, and for how long (0 if not).
+    uint32_t _responseFrom;
+    uint32_t _responseTimeout;
+
+    // The number of commands sent, and of those that failed with an error or timed out.
+    uint32_t _commandCount;
+    uint32_t _errorCount;
+    uint32_t _timeoutCount;
+
+    // The time the last command was sent.
+    uint32_t _commandStart;
+
+    // The power state, since when the modem is in that state, and the time spent in each state.
+    PowerStates _powerState;
+    uint32_t _powerStateSince;
+    uint32_t _stateTime[PowerStateCount];
+    uint32_t _stateCurrent[PowerStateCount];
+    uint32_t _commandTime;
+    uint32_t _messagesSent;
+
+    // How long on() waits for each probe, and how long the last power up took.
+    uint32_t _bootProbeTimeout;
+    uint32_t _bootTime;
+
+    // The evidence for the reboot policy: the registration status and since when,
+    // the number of consecutive failed commands and the last +CME ERROR.
+    RebootPolicy _rebootPolicy;
+    int8_t   _regStatus;
+    uint32_t _regStatusSince;
+    uint8_t  _failedCommands;
+    int16_t  _lastCMEError;
+
+    // The policies and statistics of the retry loops.
+    RetryPolicy     _retryPolicy[RetryLoopCount];
+    RetryStatistics _retryStatistics[RetryLoopCount];
+
+    // The (optional) store of the last network and how long to try it before searching.
+    Sodaq_N3X_NetworkStore* _networkStore;
+    uint32_t _fastAttachTimeout;
+
+    // The timeline of the last connect() attempt, and the (optional) history of attempts.
+    ConnectTimeline  _connectTimeline;
+    ConnectTimeline* _connectHistory;
+    uint8_t          _connectHistorySize;
+    uint32_t         _connectHistoryCount;
+
+#ifdef SODAQ_N3X_PROFILE
+    // The time spent in each of the parsing hot spots.
+    ProfileCounter _profile[ProfilePointCount];
+#endif
+
     // Initializes the input buffer and makes sure it is only initialized once.
     // Safe to call multiple times.
     void initBuffer();
@@ -296,7 +980,7 @@ private:
     void setModemStream(Stream& stream);
 
     // Returns a character from the modem stream if read within _timeout ms or -1 otherwise.
-    int timedRead(uint32_t timeout = 1000) const;
+    int timedRead(uint32_t timeout = 1000);
 
     // Fills the given "buffer" with characters read from the modem stream up to "length"
     // maximum characters and until the "terminator" character is found or a character read
@@ -351,4 +1035,43 @@ private:
     size_t println(void);
 };
 
+// Writes a datagram straight to the modem, hex encoding each byte on the fly, see beginPayload().
+// Before beginPayload() it only counts the bytes written, to find the length of a payload first.
+class Sodaq_N3X_Payload : public Print
+{
+public:
+    Sodaq_N3X_Payload() : _modem(0), _socketID(0), _size(0), _length(0), _ended(false) {}
+
+    // Sends the payload, if that was not done yet.
+    ~Sodaq_N3X_Payload() { end(); }
+
+    // Writes a byte of the payload. Returns 0 if the payload is already complete or ended.
+    size_t write(uint8_t value);
+    using Print::write;
+
+    // Sends the payload. Returns the number of bytes sent, or 0 if that failed,
+    // also when fewer bytes were written than the length given to beginPayload(),
+    // when beginPayload() failed, or when the payload was already sent.
+    // Before beginPayload() returns the number of bytes written.
+    size_t end();
+
+    // Returns the number of bytes written.
+    size_t length() const { return _length; }
+
+private:
+    friend class Sodaq_N3X;
+
+    Sodaq_N3X* _modem;
+    uint8_t    _socketID;
+    size_t     _size;
+    size_t     _length;
+
+    // True once the payload was sent, or beginPayload() failed.
+    bool       _ended;
+
+    // Not copyable, the payload owns the modem until it is sent.
+    Sodaq_N3X_Payload(const Sodaq_N3X_Payload&);
+    Sodaq_N3X_Payload& operator=(const Sodaq_N3X_Payload&);
+};
+
 #endif
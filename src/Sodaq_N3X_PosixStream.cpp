@@ -0,0 +1,322 @@
+/*
+Copyright (c) 2020 - 2021, SODAQ
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "Sodaq_N3X_PosixStream.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CR '\r'
+
+uint32_t sodaq_posix_millis()
+{
+    static uint64_t start = 0;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t now = static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+
+    if (start == 0) {
+        start = now;
+    }
+
+    return static_cast<uint32_t>(now - start);
+}
+
+static bool baudrateToSpeed(uint32_t baudrate, speed_t* speed)
+{
+    switch (baudrate) {
+    case 9600:   *speed = B9600;   return true;
+    case 19200:  *speed = B19200;  return true;
+    case 38400:  *speed = B38400;  return true;
+    case 57600:  *speed = B57600;  return true;
+    case 115200: *speed = B115200; return true;
+    case 230400: *speed = B230400; return true;
+    default:     return false;
+    }
+}
+
+Sodaq_N3X_PosixStream::Sodaq_N3X_PosixStream() :
+    _fd(-1),
+    _ownsFd(false),
+    _readWait(0),
+    _rxHead(0),
+    _rxTail(0),
+    _txSize(0)
+{
+}
+
+Sodaq_N3X_PosixStream::~Sodaq_N3X_PosixStream()
+{
+    end();
+}
+
+// Opens the given serial device and configures it as a raw port with the given baudrate.
+// Returns true if successful.
+bool Sodaq_N3X_PosixStream::begin(const char* device, uint32_t baudrate)
+{
+    end();
+
+    int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (!begin(fd, baudrate)) {
+        close(fd);
+        return false;
+    }
+
+    _ownsFd = true;
+
+    return true;
+}
+
+// Uses an already opened file descriptor (e.g. one side of a pseudo-terminal pair).
+// Returns true if successful.
+bool Sodaq_N3X_PosixStream::begin(int fd, uint32_t baudrate)
+{
+    end();
+
+    if (fd < 0) {
+        return false;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return false;
+    }
+
+    _fd = fd;
+
+    if (!configure(baudrate)) {
+        _fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+// Flushes pending output and closes the port (if it was opened by begin(device)).
+void Sodaq_N3X_PosixStream::end()
+{
+    if (_fd < 0) {
+        return;
+    }
+
+    flushOutput();
+
+    if (_ownsFd) {
+        close(_fd);
+    }
+
+    _fd     = -1;
+    _ownsFd = false;
+    _rxHead = 0;
+    _rxTail = 0;
+    _txSize = 0;
+}
+
+int Sodaq_N3X_PosixStream::available()
+{
+    return static_cast<int>(fill());
+}
+
+int Sodaq_N3X_PosixStream::read()
+{
+    if (fill() == 0) {
+        return -1;
+    }
+
+    return _rxBuffer[_rxHead++];
+}
+
+int Sodaq_N3X_PosixStream::peek()
+{
+    if (fill() == 0) {
+        return -1;
+    }
+
+    return _rxBuffer[_rxHead];
+}
+
+void Sodaq_N3X_PosixStream::flush()
+{
+    if (flushOutput()) {
+        tcdrain(_fd);
+    }
+}
+
+size_t Sodaq_N3X_PosixStream::write(uint8_t value)
+{
+    return write(&value, 1);
+}
+
+size_t Sodaq_N3X_PosixStream::write(const uint8_t* buffer, size_t size)
+{
+    if (_fd < 0) {
+        return 0;
+    }
+
+    bool endOfCommand = false;
+
+    for (size_t i = 0; i < size; i++) {
+        if (_txSize == sizeof(_txBuffer) && !flushOutput()) {
+            return i;
+        }
+
+        _txBuffer[_txSize++] = buffer[i];
+        endOfCommand |= (buffer[i] == CR);
+    }
+
+    if (endOfCommand) {
+        flushOutput();
+    }
+
+    return size;
+}
+
+// Sets the port in raw mode and (optionally) sets the baudrate.
+bool Sodaq_N3X_PosixStream::configure(uint32_t baudrate)
+{
+    struct termios tio;
+
+    if (tcgetattr(_fd, &tio) != 0) {
+        return false;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_cc[VMIN]  = 0;
+    tio.c_cc[VTIME] = 0;
+
+    if (baudrate > 0) {
+        speed_t speed;
+
+        if (!baudrateToSpeed(baudrate, &speed)) {
+            return false;
+        }
+
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+
+    return tcsetattr(_fd, TCSANOW, &tio) == 0;
+}
+
+// Fills the read-ahead buffer with one read() call if it is empty.
+// Returns the number of buffered bytes.
+size_t Sodaq_N3X_PosixStream::fill()
+{
+    if (_rxHead < _rxTail) {
+        return _rxTail - _rxHead;
+    }
+
+    _rxHead = 0;
+    _rxTail = 0;
+
+    if (_fd < 0) {
+        return 0;
+    }
+
+    // Don't keep a command in the output buffer while waiting for its response.
+    flushOutput();
+
+    if (_readWait > 0) {
+        struct pollfd pfd = { _fd, POLLIN, 0 };
+
+        if (poll(&pfd, 1, static_cast<int>(_readWait)) <= 0) {
+            return 0;
+        }
+    }
+
+    ssize_t count = ::read(_fd, _rxBuffer, sizeof(_rxBuffer));
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    _rxTail = static_cast<size_t>(count);
+
+    return _rxTail;
+}
+
+// Writes all pending output to the port.
+bool Sodaq_N3X_PosixStream::flushOutput()
+{
+    if (_txSize == 0) {
+        return true;
+    }
+
+    bool b = writeAll(_txBuffer, _txSize);
+    _txSize = 0;
+
+    return b;
+}
+
+// Writes the whole buffer to the port, waiting for the port to drain if needed.
+bool Sodaq_N3X_PosixStream::writeAll(const uint8_t* buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t count = ::write(_fd, buffer, size);
+
+        if (count > 0) {
+            buffer += count;
+            size   -= count;
+            continue;
+        }
+
+        if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return false;
+        }
+
+        struct pollfd pfd = { _fd, POLLOUT, 0 };
+
+        if (poll(&pfd, 1, 1000) <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2020 - 2021, SODAQ
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors
+may be used to endorse or promote products derived from this software without
+specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef _Sodaq_N3X_PosixStream_h
+#define _Sodaq_N3X_PosixStream_h
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "Arduino.h"
+
+#define SODAQ_N3X_POSIX_RX_BUFFER_SIZE 512
+#define SODAQ_N3X_POSIX_TX_BUFFER_SIZE 256
+
+// Returns the milliseconds elapsed on CLOCK_MONOTONIC since the first call.
+// Hosts running the library on top of an Arduino API shim should use this as millis().
+uint32_t sodaq_posix_millis();
+
+// Stream implementation over a termios file descriptor, for running Sodaq_N3X on
+// Linux hosts (e.g. a SARA N3X behind an USB-UART adapter).
+//
+// Reads are non-blocking and served from a read-ahead buffer, so the per character
+// read() calls done by the modem class don't turn into a system call per byte.
+// Writes are collected and sent in one system call on CR (end of an AT command),
+// when the buffer is full, on flush() or before the stream is read.
+class Sodaq_N3X_PosixStream : public Stream
+{
+public:
+    Sodaq_N3X_PosixStream();
+    ~Sodaq_N3X_PosixStream();
+
+    // Opens the given serial device and configures it as a raw port with the given baudrate.
+    // Returns true if successful.
+    bool begin(const char* device, uint32_t baudrate);
+
+    // Uses an already opened file descriptor (e.g. one side of a pseudo-terminal pair).
+    // The descriptor is not closed by end(). The port speed is only set if baudrate is not 0.
+    // Returns true if successful.
+    bool begin(int fd, uint32_t baudrate = 0);
+
+    // Flushes pending output and closes the port (if it was opened by begin(device)).
+    void end();
+
+    // Returns the underlying file descriptor or -1 if the stream is not open.
+    int getFd() const { return _fd; }
+
+    // Sets how long (in ms) read(), peek() and available() may wait in poll() for data
+    // when the read-ahead buffer is empty. Defaults to 0 (never wait).
+    void setReadWait(uint32_t ms) { _readWait = ms; }
+
+    int available();
+    int read();
+    int peek();
+    void flush();
+
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* buffer, size_t size);
+    using Print::write;
+
+private:
+    // The file descriptor of the port, -1 if not open.
+    int _fd;
+
+    // True if the file descriptor was opened (and has to be closed) by this instance.
+    bool _ownsFd;
+
+    // The time to wait in poll() for incoming data.
+    uint32_t _readWait;
+
+    // The read-ahead buffer, valid from _rxHead up to _rxTail.
+    uint8_t _rxBuffer[SODAQ_N3X_POSIX_RX_BUFFER_SIZE];
+    size_t  _rxHead;
+    size_t  _rxTail;
+
+    // The pending output.
+    uint8_t _txBuffer[SODAQ_N3X_POSIX_TX_BUFFER_SIZE];
+    size_t  _txSize;
+
+    // Sets the port in raw mode and (optionally) sets the baudrate.
+    bool configure(uint32_t baudrate);
+
+    // Fills the read-ahead buffer with one read() call if it is empty.
+    // Returns the number of buffered bytes.
+    size_t fill();
+
+    // Writes all pending output to the port.
+    bool flushOutput();
+
+    // Writes the whole buffer to the port, waiting for the port to drain if needed.
+    bool writeAll(const uint8_t* buffer, size_t size);
+};
+
+#endif
+
+#endif